@@ -14,7 +14,7 @@ class StdDefinitions: MimsyPlugin, MimsyDefinitions
         {
             app.registerProject(.opened, onOpened)
             app.registerProject(.closing, onClosing)
-            app.registerProject(.changed, onChanged)
+            app.registerProjectChanged(onChanged)
 
 //            app.registerWithSelectionTextContextMenu(.Lookup, callback: addLogItem)
         }
@@ -45,8 +45,11 @@ class StdDefinitions: MimsyPlugin, MimsyDefinitions
         if let project = view.project
         {
             return [TextContextMenuItem(title: "Log Definitions", invoke: {_ in
-                self.dumpPaths("Declarations", self.declarations[project.path] ?? [:])
-                self.dumpPaths("Definitions", self.definitions[project.path] ?? [:])
+                if let store = self.symbols[project.path]
+                {
+                    self.dumpPaths("Declarations", store, definitions: false)
+                    self.dumpPaths("Definitions", store, definitions: true)
+                }
             })]
         }
         
@@ -69,233 +72,533 @@ class StdDefinitions: MimsyPlugin, MimsyDefinitions
     
     func declarations(_ project: MimsyProject, name: String) -> [ItemPath]
     {
-        return declarations[project.path]?[name] ?? []
+        return symbols[project.path]?.items(name, definitions: false) ?? []
     }
     
     func definitions(_ project: MimsyProject, name: String) -> [ItemPath]
     {
-        return definitions[project.path]?[name] ?? []
+        return symbols[project.path]?.items(name, definitions: true) ?? []
     }
     
+    func names(_ project: MimsyProject, prefix: String) -> [String]
+    {
+        return symbols[project.path]?.names(withPrefix: prefix) ?? []
+    }
+    
+    // The cached index is loaded before scanning so that Goto Definition works as
+    // soon as the project is opened. The scan then re-parses only the files which
+    // changed since the cache was saved.
     func onOpened(_ project: MimsyProject)
     {
-        projects[project.path] = ProjectInfo(modTime: 0.0, files: [:])
-        startScanning(project)
+        let root = project.path
+        projects[root] = ProjectInfo()
+        states[root] = .scanning
+        
+        pending[root] = [Dirty(path: root, recursive: true)]
+        for dir in project.settings.stringValues("ExtraDirectory")
+        {
+            pending[root]!.append(Dirty(path: MimsyPath(withString: dir), recursive: true))
+        }
+        
+        let concurrent = DispatchQueue.global(qos: .userInitiated)
+        concurrent.async
+        {
+            let cached = self.loadCache(root)
+            
+            DispatchQueue.main.async
+            {
+                if self.projects[root] != nil
+                {
+                    if let cached = cached
+                    {
+                        self.projects[root] = cached.0
+                        self.symbols[root] = cached.1
+                    }
+                    
+                    self.states[root] = .idle
+                    self.startScanning(project)
+                }
+            }
+        }
     }
     
-    // TODO: Could cache this data which would definitely help remote volumes (for samba
-    // over VPN I am getting a pathetic 7 files/second even after tuning both this code
-    // and the samba configuration).
     func onClosing(_ project: MimsyProject)
     {
-        projects[project.path] = nil
-        states[project.path] = nil
+        let root = project.path
+        if let info = projects[root], let store = symbols[root], !info.files.isEmpty
+        {
+            let concurrent = DispatchQueue.global(qos: .utility)
+            concurrent.async {self.saveCache(root, info, store)}
+        }
+        
+        projects[root] = nil
+        states[root] = nil
+        pending[root] = nil
+        symbols[root] = nil
     }
     
-    func onChanged(_ project: MimsyProject)
+    func onChanged(_ project: MimsyProject, _ path: MimsyPath, _ recursive: Bool)
     {
-        switch states[project.path]!
+        let root = project.path
+        if projects[root] != nil
         {
-        case .idle:
-            startScanning(project)
-        case .scanning:
-            states[project.path] = .queued
-        case .queued:
-            break
+            pending[root]!.append(Dirty(path: path, recursive: recursive))
+            if states[root]! == .idle
+            {
+                startScanning(project)
+            }
         }
     }
     
+    // Only the paths which changed are scanned and, of those, only the files whose
+    // contents changed are parsed. When the scan finishes we queue up another scan
+    // if more changes arrived while it was running.
     func startScanning(_ project: MimsyProject)
     {
         let root = project.path
-        assert(states[root] ?? .idle != .scanning)
+        assert(states[root]! == .idle)
         states[root] = .scanning
         
+        let old = projects[root]!
+        let dirty = pending[root]!
+        pending[root] = []
+        
         let concurrent = DispatchQueue.global(qos: .background)
-        concurrent.async {self.scanProject(project, Date().timeIntervalSince1970)}
+        concurrent.async
+        {
+            let startTime = Date().timeIntervalSince1970
+            let changes = Changes()
+            for entry in dirty
+            {
+                self.scanPath(old, entry, changes)
+            }
+            self.checkFiles(old, Array(changes.candidates), changes)
+            
+            // The first scan has nothing to patch so we can build the store here instead
+            // of on the main thread.
+            let built = old.files.isEmpty ? self.buildStore(changes.parsed) : nil
+            
+            DispatchQueue.main.async
+            {
+                // Only update the project if it's still open.
+                if self.projects[root] != nil
+                {
+                    self.applyChanges(root, changes, built)
+                    self.reportElapsed(project, changes.numParsed, startTime)
+                    
+                    // Full scans are rare so we also save the cache after them in case
+                    // we don't get a chance to when the project is closed.
+                    if dirty.contains(where: {$0.recursive}) && (changes.numParsed > 0 || !changes.removed.isEmpty)
+                    {
+                        let info = self.projects[root]!
+                        let store = self.symbols[root]!
+                        concurrent.async {self.saveCache(root, info, store)}
+                    }
+                    
+                    self.states[root] = .idle
+                    if !self.pending[root]!.isEmpty
+                    {
+                        self.startScanning(project)
+                    }
+                }
+            }
+        }
+    }
+    
+    func reportElapsed(_ project: MimsyProject, _ count: Int, _ startTime: TimeInterval)
+    {
+        if count > 0 && app.settings.boolValue("ReportElapsedTimes", missing: false)
+        {
+            let elapsed = Date().timeIntervalSince1970 - startTime
+            app.transcript().writeLine(.plain, "Parsed %@ for definitions in %.1fs (%.2f files/sec)", project.path, elapsed, TimeInterval(count)/elapsed)
+        }
     }
     
     // Threaded code
-    func scanProject(_ project: MimsyProject, _ startTime: TimeInterval)
+    func scanPath(_ old: ProjectInfo, _ entry: Dirty, _ changes: Changes)
     {
-        func reportElapsed(_ count: Int)
+        let path = entry.path
+        var isDir: ObjCBool = false
+        if !FileManager.default.fileExists(atPath: path.asString(), isDirectory: &isDir)
+        {
+            removeUnder(old, path, changes)
+            changes.removed.insert(path)
+        }
+        else if !isDir.boolValue
         {
-            if app.settings.boolValue("ReportElapsedTimes", missing: false)
+            if let name = path.extensionName(), self.parsers.keys.contains(name)
             {
-                let elapsed = Date().timeIntervalSince1970 - startTime
-                app.transcript().writeLine(.plain, "Parsed %@ for definitions in %.1fs (%.2f files/sec)", project.path, elapsed, TimeInterval(count)/elapsed)
+                changes.candidates.insert(path)
             }
         }
-        
-        var latestModTime = 0.0
-        var newInfo: [MimsyPath: [ItemName]] = [:]
-
-        let root = project.path
-        
-        var count = scanDir(&newInfo, &latestModTime, root, root)
-        for dir in project.settings.stringValues("ExtraDirectory")
+        else if entry.recursive || !old.dirs.contains(path)
         {
-            count += scanDir(&newInfo, &latestModTime, root, MimsyPath(withString: dir))
+            scanTree(old, path, changes)
         }
-        
-        let (decs, defs) = buildPaths(newInfo)
-        //        dumpPaths("Declarations", decs)
-        //        dumpPaths("Definitions", defs)
-        
-        let main = DispatchQueue.main
-        let delay = DispatchTime.now() + Double(Int64(0*NSEC_PER_MSEC)) / Double(NSEC_PER_SEC)
-        main.asyncAfter(deadline: delay)
+        else
         {
-            // Update the projects dictionary, but only if the project is still open.
-            if let _ = self.projects[root]
-            {
-                self.projects[root] = ProjectInfo(modTime: latestModTime, files: newInfo)
-                self.declarations[root] = decs
-                self.definitions[root] = defs
-//                reportElapsed(count)
-                
-                switch self.states[root]!
-                {
-                case .idle:
-                    //assert(false)
-                    break
-                    
-                case .scanning:
-                    self.states[root] = .idle
-                    
-                case .queued:
-                    self.startScanning(project)
-                }
-            }
+            scanDir(old, path, changes)
         }
     }
     
     // Threaded code
-    func scanDir(_ newInfo: inout [MimsyPath: [ItemName]], _ latestModTime: inout Double, _ root: MimsyPath, _ dir: MimsyPath) -> Int
+    func scanTree(_ old: ProjectInfo, _ dir: MimsyPath, _ changes: Changes)
     {
-        let oldInfo = projects[root]
-        var count = 0
+        var seen = Set<MimsyPath>()
         
-        func shouldProcess(_ dir: MimsyPath, _ fileName: String) -> Bool
+        func shouldProcess(_ parent: MimsyPath, _ fileName: String) -> Bool
         {
-            let path = dir.append(component: fileName)
+            let path = parent.append(component: fileName)
             if let name = path.extensionName(), self.parsers.keys.contains(name)
             {
-                do
-                {
-                    let mtime = try path.modTime()
-                    latestModTime = max(mtime, latestModTime)
-                    
-                    switch oldInfo
-                    {
-                    case .some(let old):
-                        if mtime > old.modTime
-                        {
-                            return true
-                        }
-                        else
-                        {
-                            newInfo[path] = old.files[path]
-                        }
-                        break
-                    case .none:
-                        return true
-                    }
-                }
-                catch let err as NSError
-                {
-                    self.app.log("Plugins", "Failed to stat %@ when trying to parse definitions: %@", path, err.localizedFailureReason!)
-                }
-                catch
-                {
-                    self.app.log("Plugins", "Failed to stat %@ when trying to parse definitions: unknown error", path)
-                }
+                seen.insert(path)
+                return true
             }
-                
             return false
         }
-    
+        
         app.enumerate(dir: dir, recursive: true,
             error: {self.app.log("Plugins", "StdDefinitions error: %@", $0)},
             predicate: shouldProcess,
             callback: {(parent, fileNames) in
-                do
+                changes.addedDirs.insert(parent)
+                for fileName in fileNames
                 {
-                    for fileName in fileNames
-                    {
-                        let name = (fileName as NSString).pathExtension
-                        let path = parent.append(component: fileName)
-
-                        let parser = self.parsers[name]!        // bang is safe because of the predicate above
-                        newInfo[path] = try parser.parse(path)
-                        count += 1
-                    }
+                    changes.candidates.insert(parent.append(component: fileName))
                 }
-                catch let err as NSError
+            })
+        
+        for path in old.files.keys where !seen.contains(path) && path.hasRoot(dir)
+        {
+            changes.removed.insert(path)
+        }
+        for path in old.dirs where !changes.addedDirs.contains(path) && path.hasRoot(dir)
+        {
+            changes.removedDirs.insert(path)
+        }
+    }
+    
+    // Files within dir were created, removed, or renamed. Note that a sub-directory
+    // may have been renamed so we need to check for those too.
+    //
+    // Threaded code
+    func scanDir(_ old: ProjectInfo, _ dir: MimsyPath, _ changes: Changes)
+    {
+        let keys: [URLResourceKey] = [.isRegularFileKey, .isDirectoryKey]
+        guard let urls = try? FileManager.default.contentsOfDirectory(at: dir.asURL(), includingPropertiesForKeys: keys, options: [.skipsHiddenFiles]) else
+        {
+            app.log("Plugins", "StdDefinitions failed to read %@", dir)
+            return
+        }
+        
+        var seenFiles = Set<MimsyPath>()
+        var seenDirs = Set<MimsyPath>()
+        for url in urls
+        {
+            let path = dir.append(component: url.lastPathComponent)
+            let values = try? url.resourceValues(forKeys: Set(keys))
+            if values?.isDirectory ?? false
+            {
+                seenDirs.insert(path)
+                if !old.dirs.contains(path)
                 {
-                    self.app.log("Plugins", "Failed to process %@ when trying to parse definitions: %@", parent, err.localizedFailureReason!)
+                    scanTree(old, path, changes)
                 }
-                catch
+            }
+            else if values?.isRegularFile ?? false
+            {
+                if let name = path.extensionName(), self.parsers.keys.contains(name)
                 {
-                    self.app.log("Plugins", "Failed to process %@ when trying to parse definitions: unknown error", parent)
+                    seenFiles.insert(path)
+                    changes.candidates.insert(path)
                 }
-            })
+            }
+        }
         
-        return count
+        for path in old.files.keys where !seenFiles.contains(path) && path.popComponent() == dir
+        {
+            changes.removed.insert(path)
+        }
+        for path in old.dirs where !seenDirs.contains(path) && path.popComponent() == dir
+        {
+            removeUnder(old, path, changes)
+        }
+    }
+    
+    // Threaded code
+    func removeUnder(_ old: ProjectInfo, _ dir: MimsyPath, _ changes: Changes)
+    {
+        for path in old.files.keys where path.hasRoot(dir)
+        {
+            changes.removed.insert(path)
+        }
+        for path in old.dirs where path.hasRoot(dir)
+        {
+            changes.removedDirs.insert(path)
+        }
     }
+    
+    // Parsing is CPU bound so the files are checked by a worker per core. One core
+    // is left for the main thread so that the UI stays responsive during big scans.
+    //
+    // Threaded code
+    func checkFiles(_ old: ProjectInfo, _ paths: [MimsyPath], _ changes: Changes)
+    {
+        let numWorkers = max(1, min(paths.count, ProcessInfo.processInfo.activeProcessorCount - 1))
+        let lock = NSLock()
+        var next = 0
         
+        DispatchQueue.concurrentPerform(iterations: numWorkers)
+        { _ in
+            while true
+            {
+                lock.lock()
+                let i = next
+                next += 1
+                lock.unlock()
+                
+                if i >= paths.count
+                {
+                    break
+                }
+                autoreleasepool {self.checkFile(old, paths[i], changes)}
+            }
+        }
+    }
+    
     // Threaded code
-    func buildPaths(_ infos: [MimsyPath: [ItemName]]) -> ([String: [ItemPath]], [String: [ItemPath]])
+    func checkFile(_ old: ProjectInfo, _ path: MimsyPath, _ changes: Changes)
     {
-        func add(_ namePaths: inout [String: [ItemPath]], _ name: String, _ path: ItemPath)
+        do
         {
-            if var paths = namePaths[name]
+            let mtime = try path.modTime()
+            let oldInfo = old.files[path]
+            if let oldInfo = oldInfo, oldInfo.modTime == mtime
             {
-                paths.append(path)
-                namePaths[name] = paths
+                return
             }
-            else
+            
+            // Things like switching branches will often touch files without changing
+            // them so we only parse files whose contents have changed.
+            let hash = try hashFile(path)
+            if let oldInfo = oldInfo, oldInfo.hash == hash
             {
-                namePaths[name] = [path]
+                changes.update(path, FileInfo(modTime: mtime, hash: hash), items: nil)
+                return
             }
+            
+            let parser = self.parsers[path.extensionName()!]!   // bangs are safe because callers check for a parser
+            changes.update(path, FileInfo(modTime: mtime, hash: hash), items: try parser.parse(path))
         }
+        catch let err as NSError
+        {
+            self.app.log("Plugins", "Failed to process %@ when trying to parse definitions: %@", path, err.localizedFailureReason ?? "unknown error")
+        }
+        catch
+        {
+            self.app.log("Plugins", "Failed to process %@ when trying to parse definitions: unknown error", path)
+        }
+    }
+    
+    // Threaded code
+    func hashFile(_ path: MimsyPath) throws -> UInt64
+    {
+        let data = try Data(contentsOf: path.asURL(), options: .alwaysMapped)
+        return hashBytes(StdDefinitions.offsetBasis, [UInt8](data))
+    }
+    
+    // Patches the symbol store instead of rebuilding it so that small changes are
+    // cheap even in large projects.
+    func applyChanges(_ root: MimsyPath, _ changes: Changes, _ built: SymbolStore?)
+    {
+        var info = projects[root]!
         
-        var decs: [String: [ItemPath]] = [:]
-        var defs: [String: [ItemPath]] = [:]
-        
-        for (path, items) in infos
+        // Take the store out of the dictionary so that it can be mutated in place.
+        var store = symbols.removeValue(forKey: root) ?? SymbolStore()
+        if let built = built
         {
-            for item in items
+            store = built
+        }
+        else
+        {
+            for path in changes.removed
             {
-                switch item
-                {
-                case .declaration(let name, let location):
-                    add(&decs, name, ItemPath(path: path, location: location))
-                case .definition(let name, let location):
-                    add(&defs, name, ItemPath(path: path, location: location))
-                }
+                store.remove(path)
             }
+            for (path, items) in changes.parsed
+            {
+                store.add(path, items)
+            }
+            store.finishUpdates()
+        }
+        
+        for path in changes.removed
+        {
+            info.files.removeValue(forKey: path)
+        }
+        for (path, file) in changes.updated
+        {
+            info.files[path] = file
         }
         
-        return (decs, defs)
+        info.dirs.subtract(changes.removedDirs)
+        info.dirs.formUnion(changes.addedDirs)
+        
+        projects[root] = info
+        symbols[root] = store
     }
     
     // Threaded code
-    func dumpPaths(_ kind: String, _ paths: [String: [ItemPath]])
+    func buildStore(_ parsed: [MimsyPath: [ItemName]]) -> SymbolStore
     {
-        if !paths.isEmpty
+        var store = SymbolStore()
+        for (path, items) in parsed
         {
-            app.log("Plugins", "\(kind):")
-            
-            var entries: [String] = []
-            for (name, items) in paths
+            store.add(path, items)
+        }
+        store.finishUpdates()
+        return store
+    }
+    
+    // Threaded code
+    func cachePath(_ root: MimsyPath) -> URL?
+    {
+        let fm = FileManager.default
+        guard let caches = fm.urls(for: .cachesDirectory, in: .userDomainMask).first else
+        {
+            return nil
+        }
+        
+        let dir = caches.appendingPathComponent("Mimsy/Definitions", isDirectory: true)
+        do
+        {
+            try fm.createDirectory(at: dir, withIntermediateDirectories: true, attributes: nil)
+        }
+        catch
+        {
+            app.log("Plugins", "StdDefinitions couldn't create %@: %@", dir.path, error.localizedDescription)
+            return nil
+        }
+        
+        let name = String(format: "%016llx.defs", hashBytes(StdDefinitions.offsetBasis, Array(root.asString().utf8)))
+        return dir.appendingPathComponent(name)
+    }
+    
+    // If the parsers change the cached items may be stale so we include this in the
+    // cache header.
+    func parsersKey() -> UInt64
+    {
+        var hash = StdDefinitions.offsetBasis
+        for name in parsers.keys.sorted()
+        {
+            hash = hashBytes(hash, Array(name.utf8))
+            hash = hashBytes(hash, Array(String(describing: type(of: parsers[name]!)).utf8))
+        }
+        return hash
+    }
+    
+    // Threaded code
+    func saveCache(_ root: MimsyPath, _ info: ProjectInfo, _ store: SymbolStore)
+    {
+        guard let url = cachePath(root) else
+        {
+            return
+        }
+        
+        var writer = CacheWriter()
+        writer.write(StdDefinitions.cacheMagic)
+        writer.write(StdDefinitions.cacheVersion)
+        writer.write(parsersKey())
+        
+        writer.write(UInt64(info.files.count))
+        for (path, file) in info.files
+        {
+            writer.write(path.asString())
+            writer.write(file.modTime.bitPattern)
+            writer.write(file.hash)
+        }
+        
+        writer.write(UInt64(info.dirs.count))
+        for dir in info.dirs
+        {
+            writer.write(dir.asString())
+        }
+        
+        store.write(&writer)
+        
+        do
+        {
+            try Data(writer.bytes).write(to: url, options: .atomic)
+        }
+        catch
+        {
+            app.log("Plugins", "StdDefinitions couldn't write %@: %@", url.path, error.localizedDescription)
+        }
+    }
+    
+    // Threaded code
+    func loadCache(_ root: MimsyPath) -> (ProjectInfo, SymbolStore)?
+    {
+        guard let url = cachePath(root), let data = try? Data(contentsOf: url, options: .alwaysMapped) else
+        {
+            return nil     // usually because the project hasn't been opened before
+        }
+        
+        var reader = CacheReader(data)
+        guard reader.readInt() == StdDefinitions.cacheMagic, reader.readInt() == StdDefinitions.cacheVersion, reader.readInt() == parsersKey() else
+        {
+            app.log("Plugins", "StdDefinitions ignoring stale cache for %@", root)
+            return nil
+        }
+        
+        var info = ProjectInfo()
+        guard let numFiles = reader.readCount(24) else {return nil}
+        for _ in 0..<numFiles
+        {
+            guard let path = reader.readString(), let modTime = reader.readInt(), let hash = reader.readInt() else {return nil}
+            info.files[MimsyPath(withString: path)] = FileInfo(modTime: Double(bitPattern: modTime), hash: hash)
+        }
+        
+        guard let numDirs = reader.readCount(8) else {return nil}
+        for _ in 0..<numDirs
+        {
+            guard let dir = reader.readString() else {return nil}
+            info.dirs.insert(MimsyPath(withString: dir))
+        }
+        
+        guard let store = SymbolStore(&reader) else {return nil}
+        
+        app.log("Plugins", "StdDefinitions loaded %ld cached files for %@", info.files.count, root)
+        return (info, store)
+    }
+    
+    func hashBytes(_ hash: UInt64, _ bytes: [UInt8]) -> UInt64
+    {
+        var result = hash
+        for byte in bytes
+        {
+            result = (result ^ UInt64(byte)) &* 1099511628211
+        }
+        return result
+    }
+    
+    // Threaded code
+    func dumpPaths(_ kind: String, _ store: SymbolStore, definitions: Bool)
+    {
+        var entries: [String] = []
+        for name in store.names(withPrefix: "")
+        {
+            let items = store.items(name, definitions: definitions)
+            if !items.isEmpty
             {
                 let loc = (items.map {"\($0.path.lastComponent()):\($0.location)"}).joined(separator: ", ")
                 entries.append("   \(name)  \(loc)")
             }
-            
-            entries.sort()
-            
+        }
+        
+        if !entries.isEmpty
+        {
+            app.log("Plugins", "\(kind):")
             for entry in entries
             {
                 app.log("Plugins", "%@", entry)
@@ -307,17 +610,360 @@ class StdDefinitions: MimsyPlugin, MimsyDefinitions
     {
         case idle
         case scanning
-        case queued
     }
     
-    struct ProjectInfo
+    // A file or directory which needs to be scanned.
+    struct Dirty
+    {
+        let path: MimsyPath
+        let recursive: Bool
+    }
+    
+    struct FileInfo
     {
         let modTime: Double
-        let files: [MimsyPath: [ItemName]]  // file paths to definitions within that file
+        let hash: UInt64
+    }
+    
+    struct ProjectInfo
+    {
+        var files: [MimsyPath: FileInfo] = [:]  // files which have been checked
+        var dirs = Set<MimsyPath>()             // directories which have been scanned
+    }
+    
+    // Cache files are a sequence of little endian UInt64s and strings (which are
+    // written as a byte count followed by UTF-8).
+    struct CacheWriter
+    {
+        var bytes: [UInt8] = []
+        
+        mutating func write(_ value: UInt64)
+        {
+            for i in 0..<8
+            {
+                bytes.append(UInt8(truncatingIfNeeded: value >> UInt64(8*i)))
+            }
+        }
+        
+        mutating func write(_ str: String)
+        {
+            let utf8 = Array(str.utf8)
+            write(UInt64(utf8.count))
+            bytes.append(contentsOf: utf8)
+        }
+    }
+    
+    struct CacheReader
+    {
+        let data: Data
+        var offset = 0
+        
+        init(_ data: Data)
+        {
+            self.data = data
+        }
+        
+        mutating func readInt() -> UInt64?
+        {
+            guard data.count - offset >= 8 else {return nil}
+            
+            var value: UInt64 = 0
+            let start = data.startIndex + offset
+            for i in 0..<8
+            {
+                value |= UInt64(data[start + i]) << UInt64(8*i)
+            }
+            offset += 8
+            return value
+        }
+        
+        // Reads the number of items in a list where each item takes at least size
+        // bytes. Returns nil if there isn't room for that many items so that corrupt
+        // counts can't cause huge allocations.
+        mutating func readCount(_ size: Int) -> Int?
+        {
+            guard let count = readInt(), count <= UInt64((data.count - offset)/size) else {return nil}
+            return Int(count)
+        }
+        
+        mutating func readString() -> String?
+        {
+            guard let count = readInt(), count <= UInt64(data.count - offset) else {return nil}
+            
+            let start = data.startIndex + offset
+            offset += Int(count)
+            return String(bytes: data[start..<start + Int(count)], encoding: .utf8)
+        }
+    }
+    
+    // What a scan found. These are applied to the ProjectInfo on the main thread.
+    class Changes
+    {
+        var candidates = Set<MimsyPath>()      // files which may have changed
+        var updated: [MimsyPath: FileInfo] = [:]
+        var parsed: [MimsyPath: [ItemName]] = [:]   // items for the updated files whose contents changed
+        var removed = Set<MimsyPath>()
+        var addedDirs = Set<MimsyPath>()
+        var removedDirs = Set<MimsyPath>()
+        var numParsed = 0
+        
+        // Called concurrently by checkFiles.
+        func update(_ path: MimsyPath, _ file: FileInfo, items: [ItemName]?)
+        {
+            lock.lock()
+            updated[path] = file
+            if let items = items
+            {
+                parsed[path] = items
+                numParsed += 1
+            }
+            lock.unlock()
+        }
+        
+        let lock = NSLock()
+    }
+    
+    // Symbol names and file paths are interned so that each is stored once and the
+    // postings for a name are small fixed size values in a contiguous array. This
+    // is a value type so a copy can be handed off to a thread (e.g. to save the
+    // cache) while the main thread continues to update the original.
+    struct SymbolStore
+    {
+        struct Posting
+        {
+            let file: Int32
+            let location: UInt32
+            let isDefinition: Bool
+        }
+        
+        init()
+        {
+        }
+        
+        // Returns nil if the cache is truncated or corrupt.
+        init?(_ reader: inout CacheReader)
+        {
+            guard let numPaths = reader.readCount(8), numPaths <= Int(Int32.max) else {return nil}
+            for id in 0..<numPaths
+            {
+                guard let path = reader.readString() else {return nil}
+                if path.isEmpty
+                {
+                    paths.append(nil)
+                    freeIds.append(Int32(id))
+                }
+                else
+                {
+                    let p = MimsyPath(withString: path)
+                    paths.append(p)
+                    fileIds[p] = Int32(id)
+                }
+                fileSymbols.append([])
+            }
+            
+            guard let numNames = reader.readCount(16) else {return nil}
+            for _ in 0..<numNames
+            {
+                guard let name = reader.readString(), let count = reader.readCount(16) else {return nil}
+                
+                let sym = intern(name)
+                postings[Int(sym)].reserveCapacity(count)
+                for _ in 0..<count
+                {
+                    guard let file = reader.readInt(), let location = reader.readInt(), file < UInt64(numPaths), paths[Int(file)] != nil else {return nil}
+                    
+                    let posting = Posting(file: Int32(file), location: UInt32(truncatingIfNeeded: location), isDefinition: location >> 32 != 0)
+                    postings[Int(sym)].append(posting)
+                    fileSymbols[Int(file)].append(sym)
+                }
+            }
+            finishUpdates()
+        }
+        
+        // Free file slots are written as empty paths so that the file ids in the
+        // postings remain valid.
+        func write(_ writer: inout CacheWriter)
+        {
+            writer.write(UInt64(paths.count))
+            for path in paths
+            {
+                writer.write(path?.asString() ?? "")
+            }
+            
+            writer.write(UInt64(symbolNames.count))
+            for (sym, name) in symbolNames.enumerated()
+            {
+                writer.write(name)
+                writer.write(UInt64(postings[sym].count))
+                for posting in postings[sym]
+                {
+                    writer.write(UInt64(posting.file))
+                    writer.write(UInt64(posting.location) | (posting.isDefinition ? 1 << 32 : 0))
+                }
+            }
+        }
+        
+        // Replaces the items for path if it was already added.
+        mutating func add(_ path: MimsyPath, _ items: [ItemName])
+        {
+            remove(path)
+            
+            let file: Int32
+            if let id = freeIds.popLast()
+            {
+                file = id
+                paths[Int(id)] = path
+            }
+            else
+            {
+                file = Int32(paths.count)
+                paths.append(path)
+                fileSymbols.append([])
+            }
+            fileIds[path] = file
+            
+            var symbols: [Int32] = []
+            symbols.reserveCapacity(items.count)
+            for item in items
+            {
+                switch item
+                {
+                case .declaration(let name, let location):
+                    let sym = intern(name)
+                    postings[Int(sym)].append(Posting(file: file, location: UInt32(clamping: location), isDefinition: false))
+                    symbols.append(sym)
+                case .definition(let name, let location):
+                    let sym = intern(name)
+                    postings[Int(sym)].append(Posting(file: file, location: UInt32(clamping: location), isDefinition: true))
+                    symbols.append(sym)
+                }
+            }
+            fileSymbols[Int(file)] = symbols
+        }
+        
+        // Names are left interned even if nothing refers to them any more: they are
+        // likely to come back when the file is re-parsed.
+        mutating func remove(_ path: MimsyPath)
+        {
+            if let file = fileIds.removeValue(forKey: path)
+            {
+                for sym in Set(fileSymbols[Int(file)])
+                {
+                    postings[Int(sym)] = postings[Int(sym)].filter {$0.file != file}
+                }
+                fileSymbols[Int(file)] = []
+                paths[Int(file)] = nil
+                freeIds.append(file)
+            }
+        }
+        
+        // Merges the names interned since the last call into the sorted names so
+        // that prefix lookups see them.
+        mutating func finishUpdates()
+        {
+            if !unsorted.isEmpty
+            {
+                let added = unsorted.sorted {symbolNames[Int($0)] < symbolNames[Int($1)]}
+                unsorted = []
+                
+                var merged: [Int32] = []
+                merged.reserveCapacity(sortedIds.count + added.count)
+                var i = 0
+                var j = 0
+                while i < sortedIds.count && j < added.count
+                {
+                    if symbolNames[Int(added[j])] < symbolNames[Int(sortedIds[i])]
+                    {
+                        merged.append(added[j])
+                        j += 1
+                    }
+                    else
+                    {
+                        merged.append(sortedIds[i])
+                        i += 1
+                    }
+                }
+                merged.append(contentsOf: sortedIds[i...])
+                merged.append(contentsOf: added[j...])
+                sortedIds = merged
+            }
+        }
+        
+        func items(_ name: String, definitions: Bool) -> [ItemPath]
+        {
+            guard let sym = nameIds[name] else {return []}
+            
+            return postings[Int(sym)].compactMap
+            {
+                $0.isDefinition == definitions ? ItemPath(path: paths[Int($0.file)]!, location: Int($0.location)) : nil
+            }
+        }
+        
+        // Returns the names, in sorted order, which start with prefix and have at least
+        // one declaration or definition.
+        func names(withPrefix prefix: String) -> [String]
+        {
+            // Binary search for the first name that is not less than prefix.
+            var lo = 0
+            var hi = sortedIds.count
+            while lo < hi
+            {
+                let mid = (lo + hi)/2
+                if symbolNames[Int(sortedIds[mid])] < prefix
+                {
+                    lo = mid + 1
+                }
+                else
+                {
+                    hi = mid
+                }
+            }
+            
+            var result: [String] = []
+            for sym in sortedIds[lo...]
+            {
+                let name = symbolNames[Int(sym)]
+                if !name.hasPrefix(prefix)
+                {
+                    break
+                }
+                if !postings[Int(sym)].isEmpty
+                {
+                    result.append(name)
+                }
+            }
+            return result
+        }
+        
+        private mutating func intern(_ name: String) -> Int32
+        {
+            if let sym = nameIds[name]
+            {
+                return sym
+            }
+            
+            let sym = Int32(symbolNames.count)
+            symbolNames.append(name)
+            nameIds[name] = sym
+            postings.append([])
+            unsorted.append(sym)
+            return sym
+        }
+        
+        private var paths: [MimsyPath?] = []            // file id to path (nil for free ids)
+        private var fileIds: [MimsyPath: Int32] = [:]
+        private var freeIds: [Int32] = []
+        private var fileSymbols: [[Int32]] = []         // file id to the names used by that file
+        private var symbolNames: [String] = []          // symbol id to name
+        private var nameIds: [String: Int32] = [:]
+        private var postings: [[Posting]] = []          // symbol id to the declarations and definitions of that name
+        private var sortedIds: [Int32] = []             // symbol ids ordered by name
+        private var unsorted: [Int32] = []              // symbol ids added since finishUpdates was last called
     }
     
-    // Project path to name to definitions.
-    typealias ProjectItemPaths = [MimsyPath: [String: [ItemPath]]]
+    static let offsetBasis: UInt64 = 14695981039346656037     // FNV-1a
+    static let cacheMagic: UInt64 = 0x5346454459534D4D          // "MMSYDEFS"
+    static let cacheVersion: UInt64 = 2
     
     var toolParsers: [ItemParser] = []      // we use separate arrays for parsers to make prioritization easier
     var parserParsers: [ItemParser] = []    // note that, while these are var, they won't change after plugins finish loading
@@ -326,7 +972,7 @@ class StdDefinitions: MimsyPlugin, MimsyDefinitions
     
     var parsers: [String: ItemParser] = [:] // key is a file extension
     var states: [MimsyPath: State] = [:]
+    var pending: [MimsyPath: [Dirty]] = [:]     // paths to scan once the current scan finishes
     var projects: [MimsyPath: ProjectInfo] = [:]    // key is a project root
-    var declarations: ProjectItemPaths = [:]
-    var definitions: ProjectItemPaths = [:]
+    var symbols: [MimsyPath: SymbolStore] = [:]     // key is a project root
 }
@@ -85,6 +85,11 @@ class StdDefinitionsParser: MimsyPlugin, ItemParser
         patterns = patterns.map {"(?:" + $0 + ")"}
         let pattern = patterns.joined(separator: "|")
         
+        // Files are parsed concurrently so the cache needs to be locked. Note that
+        // NSRegularExpression itself is thread safe.
+        regexenLock.lock()
+        defer {regexenLock.unlock()}
+        
         if let re = regexen[pattern]
         {
             return re
@@ -157,5 +162,6 @@ class StdDefinitionsParser: MimsyPlugin, ItemParser
     }
     
     var regexen: [String: NSRegularExpression] = [:]    // key is a regex pattern
+    let regexenLock = NSLock()
     var languages: [String: MimsyLanguage] = [:]        // key is a file extension
 }
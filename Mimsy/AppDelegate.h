@@ -53,6 +53,7 @@ void initLogGlobs(void);
 - (Settings* _Nonnull)layeredSettings;
 
 - (void)invokeProjectHook:(enum ProjectNotification)kind project:(id<MimsyProject> _Nonnull)project;
+- (void)invokeProjectHook:(id<MimsyProject> _Nonnull)project path:(MimsyPath* _Nonnull)path recursive:(bool)recursive;
 - (void)invokeTextViewHook:(enum TextViewNotification)kind view:(id<MimsyTextView> _Nonnull)view;
 - (bool)invokeTextViewKeyHook:(NSString* _Nonnull)key view:(id<MimsyTextView> _Nonnull)view;
 
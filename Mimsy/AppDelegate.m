@@ -7,6 +7,7 @@
 #import "ConfigParser.h"
 #import "Constants.h"
 #import "DirectoryController.h"
+#import "DirectoryWalker.h"
 #import "DirectoryWatcher.h"
 #import "FindInFilesController.h"
 #import "FindResultsController.h"
@@ -24,6 +25,7 @@
 #import "SearchSite.h"
 #import "SelectStyleController.h"
 #import "SpecialKeys.h"
+#import "StyleCache.h"
 #import "TextController.h"
 #import "TimeMachine.h"
 #import "TranscriptController.h"
@@ -36,6 +38,7 @@ typedef void (^MenuInvokeBlock)(void);
 typedef void (^TextViewBlock)(id<MimsyTextView> _Nonnull);
 typedef BOOL (^TextViewKeyBlock)(id<MimsyTextView> _Nonnull);
 typedef void (^ProjectBlock)(id<MimsyProject> _Nonnull);
+typedef void (^ProjectPathBlock)(id<MimsyProject> _Nonnull, MimsyPath* _Nonnull, BOOL);
 
 @implementation ProjectContextItem
 
@@ -206,6 +209,7 @@ void initLogGlobs()
 	DirectoryWatcher* _stylesWatcher;
 	DirectoryWatcher* _helpWatcher;
     NSMutableDictionary* _projectHooks;
+    NSMutableArray* _projectPathHooks;
     NSMutableDictionary* _textHooks;
     NSMutableDictionary* _textKeyHooks;
     
@@ -244,6 +248,7 @@ void initLogGlobs()
 		
         _items = [NSMutableDictionary new];
         _projectHooks = [NSMutableDictionary new];
+        _projectPathHooks = [NSMutableArray new];
         _textHooks = [NSMutableDictionary new];
         _textKeyHooks = [NSMutableDictionary new];
         _noSelectionItems = [NSMutableDictionary new];
@@ -389,63 +394,16 @@ void initLogGlobs()
 
 - (void)enumerateWithDir:(MimsyPath* __nonnull)root recursive:(BOOL)recursive error:(__attribute__((noescape)) void (^ __nonnull)(NSString* __nonnull))error predicate:(__attribute__((noescape)) BOOL (^)(MimsyPath* __nonnull, NSString* __nonnull))predicate callback:(__attribute__((noescape)) void (^ __nonnull)(MimsyPath* __nonnull, NSArray<NSString*>* __nonnull))callback
 {
-    NSMutableArray<MimsyPath*>* dirs = [NSMutableArray new];
-    [dirs addObject:root];
-    
-    NSMutableArray<NSString*>* fileNames = [NSMutableArray new];
-    while (dirs.count > 0)
-    {
-        MimsyPath* dir = [dirs lastObject];
-        [dirs removeLastObject];
-        
-        DIR* dirP = opendir(dir.asString.UTF8String);
-        if (!dirP)
-        {
-            NSString* mesg = [[NSString alloc] initWithFormat:@"Failed to open '%@': %s.", dir, strerror(errno)];
-            error(mesg);
-            continue;
-        }
-        
-        struct dirent entry;
-        struct dirent* entryP;
-        [fileNames removeAllObjects];
-        while (true)
-        {
-            int err = readdir_r(dirP, &entry, &entryP);
-            if (err)
-            {
-                NSString* mesg = [[NSString alloc] initWithFormat:@"Failed to read '%@': %s.", dir, strerror(errno)];
-                error(mesg);
-                break;
-            }
-            else if (!entryP)
-            {
-                break;
-            }
-            
-            if (entry.d_name[0] != '.')
-            {
-                if (entry.d_type == DT_REG)
-                {
-                    NSString* fileName = [[NSString alloc] initWithBytes:entry.d_name length:entry.d_namlen encoding:NSUTF8StringEncoding];
-                    if (!predicate || predicate(dir, fileName))
-                        [fileNames addObject:fileName];
-                }
-                else if (recursive && entry.d_type == DT_DIR)
-                {
-                    NSString* fileName = [[NSString alloc] initWithBytes:entry.d_name length:entry.d_namlen encoding:NSUTF8StringEncoding];
-                    MimsyPath* path = [dir appendWithComponent:fileName];
-                    [dirs addObject:path];
-                }
-            }
-        }
+    // Callers of this aren't thread safe so everything happens on this thread.
+    [DirectoryWalker walk:root recursive:recursive threads:1 error:error dirPredicate:nil predicate:predicate callback:callback];
+}
 
-        // Batching the files up should be faster because w'll get better locality reading the directory
-        // contents before dealing with files. Probably won't make much difference for local volumes but
-        // remote volumes can be quite slow.
-        callback(dir, fileNames);
-        (void) closedir(dirP);
-    }
+- (void)enumerateConcurrentlyWithDir:(MimsyPath* __nonnull)root recursive:(BOOL)recursive error:(void (^ __nonnull)(NSString* __nonnull))error dirPredicate:(BOOL (^ __nonnull)(MimsyPath* __nonnull, NSString* __nonnull))dirPredicate predicate:(BOOL (^ __nonnull)(MimsyPath* __nonnull, NSString* __nonnull))predicate callback:(void (^ __nonnull)(MimsyPath* __nonnull, NSArray<NSString*>* __nonnull))callback
+{
+    // Reading directories mostly means waiting on the file system so this isn't
+    // tied to the number of cores.
+    const NSUInteger NumWalkerThreads = 8;
+    [DirectoryWalker walk:root recursive:recursive threads:NumWalkerThreads error:error dirPredicate:dirPredicate predicate:predicate callback:callback];
 }
 
 - (void)addKeyHelp:(NSString * __nonnull)plugin :(NSString * __nonnull)context :(NSString * __nonnull)key :(NSString * __nonnull)description
@@ -654,6 +612,19 @@ void initLogGlobs()
     }
 }
 
+- (void)registerProjectChanged:(ProjectPathBlock)hook
+{
+    [_projectPathHooks addObject:hook];
+}
+
+- (void)invokeProjectHook:(id<MimsyProject> _Nonnull)project path:(MimsyPath* _Nonnull)path recursive:(bool)recursive
+{
+    for (ProjectPathBlock hook in _projectPathHooks)
+    {
+        hook(project, path, recursive);
+    }
+}
+
 - (void)registerTextView:(enum TextViewNotification)kind :(__attribute__((noescape)) TextViewBlock)hook
 {
     NSValue* key = @((int) kind);
@@ -788,6 +759,7 @@ void initLogGlobs()
     [TranscriptController writeInfo:@""];   // make sure we create this within the main thread
     [SpecialKeys setup];
     [WindowsDatabase setup];
+    [StyleCache setup];
     [Languages setup];
     
     [Plugins finishLoading];
@@ -13,6 +13,15 @@
 /// Called with the start of a range which has been edited.
 - (void)addDirtyLocation:(NSUInteger)loc reason:(NSString*)reason;
 
+/// Called when the text is edited. Range is the edited range within the new text
+/// and delta is the change in the text's length. This allows the styler to re-lex
+/// just the text around the edits.
+- (void)addDirtyRange:(NSRange)range delta:(NSInteger)delta reason:(NSString*)reason;
+
+/// Persists the runs for the document (if it's unedited and large enough to
+/// be worth caching) so that it can be styled quickly when it's re-opened.
+- (void)saveRuns;
+
 - (void)toggleBraceHighlightFrom:(NSUInteger)from to:(NSUInteger)to on:(bool)on;
 
 /// True if some styles were applied.
@@ -2,9 +2,13 @@
 
 #import "AppDelegate.h"
 #import "AsyncStyler.h"
+#import "GlyphScanner.h"
 #import "GlyphsAttribute.h"
+#import "Language.h"
 #import "Logger.h"
+#import "StyleCache.h"
 #import "StyleRuns.h"
+#import "StyledTextStorage.h"
 #import "TextController.h"
 #import "TextStyles.h"
 #import "TextView.h"
@@ -24,91 +28,243 @@
 // operation is as follows:
 // 1) When a text document with a language is changed ApplyStyles addDirtyLocation:reason:
 // is called which queues up a concurrent task to associate all of the document's text
-// with an element name and range.
+// with an element name and range. If we have runs from a previous task and know what was
+// edited since then only the text around the edits is re-lexed.
 // 2) ApplyStyles is called on the main thread with the run information.
-// 3) ApplyStyles skips over any runs that were previously applied. This is much faster
-// than re-applying them.
-// 4) The new runs are applied from the top down using a 50ms window. Conceptually it would
-// make more sense to sort the runs so that the runs closest to what the user is viewing are
-// applied first, but that tends to cause the text to jump around when lines have differing
-// heights.
-// 5) If there are more runs to apply then queue up a block to execute on the main thread.
+// 3) The runs are handed off to the text storage which answers the syntax attributes
+// directly from the runs (so styles are never copied into NSTextStorage attribute runs).
+// It compares the new runs with the old runs and only the range which is styled differently
+// is redrawn so this is usually proportional to the size of the edit.
+// 4) Styles which aren't part of the runs (glyph mappings and plugin hooks) are added to
+// the changed range.
+// 5) If the text was edited after the runs were computed then queue up another task.
+
+// Summarizes a series of edits: range is the portion of the current text that was
+// edited and delta is the change in the text's length.
+struct EditSpan
+{
+	NSRange range;
+	NSInteger delta;
+	bool valid;
+};
+
+static void addEdit(struct EditSpan* span, NSRange range, NSInteger delta)
+{
+	if (!span->valid)
+	{
+		span->range = range;
+		span->delta = delta;
+		span->valid = true;
+	}
+	else
+	{
+		// Map the end of the old edited range into the new text and union it
+		// with the new edit (the start can only move if it's within the edit).
+		NSInteger oldEnd = (NSInteger) NSMaxRange(range) - delta;		// end of the replaced text within the old text
+		NSInteger end = (NSInteger) NSMaxRange(span->range);
+		if (end >= oldEnd)
+			end += delta;
+		end = MAX(end, (NSInteger) NSMaxRange(range));
+		
+		NSUInteger start = MIN(span->range.location, range.location);
+		span->range = NSMakeRange(start, (NSUInteger) end - start);
+		span->delta += delta;
+	}
+}
+
 @implementation ApplyStyles
 {
 	__weak TextController* _controller;
 	NSUInteger _firstDirtyLoc;
-	struct StyleRunVector _appliedRuns;
 	bool _queued;
 	NSDictionary* _braceAttrs;
 	NSUInteger _braceLeft;
 	NSUInteger _braceRight;
+	
+	StyleRuns* _lastRuns;		// runs from the last styler task
+	GlyphRuns* _lastGlyphs;		// glyph runs for the same text as _lastRuns (may be nil)
+	RegexStyler* _lastStyler;	// the styler used to compute _lastRuns
+	struct EditSpan _edits;		// edits made since _lastRuns was computed
+	StylerToken* _token;		// used to cancel the current styler task
 }
 
 - (id)init:(TextController*)controller
 {
 	_controller = controller;
-	_appliedRuns = newStyleRunVector();
 	_braceAttrs = @{NSBackgroundColorAttributeName: [NSColor selectedTextBackgroundColor]};
 	return self;
 }
 
+// The text continues to use the old styles until the new runs are installed (and,
+// because the location is zero, those are applied to all of the text).
 - (void)resetStyles
 {
-	TextController* tmp = _controller;
-	if (tmp)
-	{
-		NSTextStorage* storage = tmp.textView.textStorage;
-		[storage setAttributes:[tmp.styles attributesForElement:@"normal"] range:NSMakeRange(0, storage.length)];
-		 
-		[self addDirtyLocation:0 reason:@"reset styles"];
-	}
+	[self addDirtyLocation:0 reason:@"reset styles"];
+}
+
+- (void)addDirtyRange:(NSRange)range delta:(NSInteger)delta reason:(NSString*)reason
+{
+	addEdit(&_edits, range, delta);
+	[self _editedBraces:range delta:delta];
+	[self addDirtyLocation:range.location reason:reason];
 }
 
 - (void)addDirtyLocation:(NSUInteger)loc reason:(NSString*)reason
 {
 	TextController* tmp = _controller;
-	if (tmp && !_queued && !tmp.closed)     // called from an async thread so we can be closed
+	if (tmp && tmp.text.length > UINT32_MAX)	// StyleRuns uses 32-bit offsets
+	{
+		LOG("Text:Styler", "Not styling %.1f GiB document", tmp.text.length/(1024.0*1024*1024));
+	}
+	else if (tmp && !_queued && !tmp.closed)     // called from an async thread so we can be closed
 	{
 		// If nothing is queued then we can apply all the runs.
 		_firstDirtyLoc = NSNotFound;
 		_queued = true;
         LOG("Text:Styler:Verbose", "Starting up AsyncStyler for %.1f KiB (%s)", tmp.text.length/1024.0, STR(reason));
 		
-		[AsyncStyler computeStylesFor:tmp.fullLanguage withText:tmp.text editCount:tmp.editCount completion:
-			^(StyleRuns* runs)
+		// Edits made while the task runs are relative to the runs it computes.
+		Language* lang = tmp.fullLanguage;
+		StyleRuns* previous = _edits.valid && _lastStyler == lang.styler ? _lastRuns : nil;
+		struct EditSpan edits = _edits;
+		_edits.valid = false;
+		
+		// The glyph runs can be patched up even if the styles can't be (and if nothing
+		// was edited they only need to be re-scanned if the glyph settings changed).
+		GlyphScanner* scanner = [[GlyphScanner alloc] initWithController:tmp];
+		NSRange edited = edits.valid ? edits.range : NSMakeRange(0, 0);
+		NSInteger delta = edits.valid ? edits.delta : 0;
+		
+		StylesCompleted completion =
+			^(StyleRuns* runs, GlyphRuns* glyphs)
 			{
                 TextController* tmp2 = self->_controller;
-				if (tmp2)
+				if (tmp2 && !runs)
 				{
-					[runs mapElementsToStyles:
-						^id(NSString* name)
-						{
-							return [tmp2.styles attributesForElement:name];
-						}
-					];
-					NSTextView* textv = tmp2.textView;
-					if (textv)
-						[textv setBackgroundColor:tmp2.styles.backColor];
-
-					if (loc > 0)
-						[self _skipApplied:runs];
-					[self _applyRuns:runs];
+					// The text was edited while the task was running so the edits it was
+					// handling are still outstanding.
+					if (edits.valid)
+						[self _restoreEdits:edits];
+					self->_firstDirtyLoc = MIN(loc, self->_firstDirtyLoc);
+					[self _queueRestyle:@"cancelled"];
 				}
-			}
-		 ];
+				else if (tmp2)
+				{
+					[self _applyComputedRuns:runs glyphs:glyphs language:lang dirty:loc];
+				}
+			};
+		
+		// When a large unedited document is opened we can usually use the runs
+		// from the last time it was open.
+		_token = [[StylerToken alloc] initWithEditCount:tmp.editCount];
+		if (loc == 0 && !_lastRuns && !edits.valid && tmp.path && ![tmp.document isDocumentEdited])
+			[AsyncStyler loadStylesFor:lang path:tmp.path glyphs:scanner withText:tmp.text editCount:tmp.editCount token:_token completion:completion];
+		else
+			[AsyncStyler computeStylesFor:lang glyphs:scanner withText:tmp.text editCount:tmp.editCount previous:previous previousGlyphs:_lastGlyphs edited:edited delta:delta token:_token completion:completion];
 	}
 	else
 	{
-		// Otherwise we can usually apply the runs up to the dirty location.
-		// The exception is stuff like the user typing the end delimiter of
-		// a string. In that case the queued up apply will fail for the last
-		// bit of text, but because _firstDirtyLoc is set we'll cycle back
-		// around to here once we hit the dirty location and fix things up
-		// then.
+		// Otherwise remember that we'll need to go around again once the
+		// queued up task finishes.
 		_firstDirtyLoc = MIN(loc, _firstDirtyLoc);
+		
+		// If the styler task is still running on text that has since been
+		// edited then there's no point in letting it finish.
+		if (tmp && _token && tmp.editCount != _token.editCount)
+			[_token cancel];
 	}
 }
 
+- (void)_applyComputedRuns:(StyleRuns*)runs glyphs:(GlyphRuns*)glyphs language:(Language*)lang dirty:(NSUInteger)loc
+{
+	TextController* tmp = _controller;
+	_lastRuns = runs;
+	_lastGlyphs = glyphs;
+	_lastStyler = lang.styler;
+	
+	[runs mapElementsToStyles:
+		^id(NSString* name)
+		{
+			return [tmp.styles attributesForElement:name];
+		}
+	];
+	NSTextView* textv = tmp.textView;
+	if (textv)
+		[textv setBackgroundColor:tmp.styles.backColor];
+	
+	// The storage can only use runs computed for the current text. Edits cancel the
+	// styler task so this is rare.
+	if (runs.editCount != tmp.editCount)
+	{
+		_firstDirtyLoc = MIN(loc, _firstDirtyLoc);
+		[self _queueRestyle:@"stale runs"];
+		return;
+	}
+	
+	AppDelegate* app = (AppDelegate*) [NSApp delegate];
+	NSDictionary* elementHooks = app.applyElementHooks;
+	StyledTextStorage* storage = (StyledTextStorage*) textv.textStorage;
+	ASSERT(!storage || [storage isKindOfClass:[StyledTextStorage class]]);
+	double startTime = getTime();
+	
+	[storage beginEditing];
+	NSRange changed = [storage setStyleRuns:runs all:loc == 0];
+	if (changed.length > 0)
+	{
+		[storage removeAttribute:NSBackgroundColorAttributeName range:changed];
+		[storage removeAttribute:NSLinkAttributeName range:changed];
+		[storage removeAttribute:NSToolTipAttributeName range:changed];
+		
+		[self _applyElementHooks:elementHooks runs:runs range:changed];
+		[self _applyRangeStylesAt:changed.location length:changed.length hooks:elementHooks storage:storage];
+	}
+	[storage endEditing];
+	
+	// NSTextView copies the attributes of the text around the caret into its typing
+	// attributes and those would go into the overlay and hide the styles.
+	[tmp resetTypingAttributes];
+	
+	double elapsed = getTime() - startTime;
+	LOG("Text:Styler:Verbose", "Installed runs, restyled (%lu, %lu) in %.1fms", changed.location, changed.length, 1000*elapsed);
+	
+	_applied = true;
+	[tmp onAppliedStyles];
+	
+	// If something was dirtied while the task ran we need to go around again.
+	if (_firstDirtyLoc != NSNotFound)
+		[self _queueRestyle:@"still dirty"];
+	else
+		_queued = false;
+}
+
+- (void)saveRuns
+{
+	TextController* tmp = _controller;
+	NSDocument* doc = tmp.document;
+	if (tmp && tmp.path && _lastRuns && _lastRuns.editCount == tmp.editCount && _lastStyler == tmp.fullLanguage.styler && !_edits.valid && ![doc isDocumentEdited])
+		[StyleCache saveRuns:_lastRuns path:tmp.path language:tmp.fullLanguage length:tmp.text.length modified:doc.fileModificationDate];
+}
+
+- (void)_restoreEdits:(struct EditSpan)edits
+{
+	if (_edits.valid)
+		addEdit(&edits, _edits.range, _edits.delta);
+	_edits = edits;
+}
+
+// If the user has done an edit there is a very good chance he'll do another
+// so defer queuing up another styler task.
+- (void)_queueRestyle:(NSString*)reason
+{
+	_queued = false;
+	
+	dispatch_queue_t main = dispatch_get_main_queue();
+	dispatch_time_t delay = dispatch_time(DISPATCH_TIME_NOW, 100*NSEC_PER_MSEC);	// 0.1s
+	dispatch_after(delay, main, ^{if (!self->_queued) [self addDirtyLocation:self->_firstDirtyLoc reason:reason];});
+}
+
+// Brace highlights are drawn as temporary layout manager attributes so they are
+// an overlay on top of the styles and moving the caret doesn't require a restyle.
 - (void)toggleBraceHighlightFrom:(NSUInteger)from to:(NSUInteger)to on:(bool)on
 {
 	if (!on)
@@ -121,420 +277,112 @@
 	{
 		if (!on || to - from > 1)
 		{
+			TextController* tmp = _controller;
+			NSLayoutManager* layout = tmp.textView.layoutManager;
+			NSUInteger length = tmp.textView.textStorage.length;
+			
+			[self _removeBraceHighlight:layout length:length];
 			_braceLeft = from;
 			_braceRight = to;
 			
-			// This is a bit crappy because it will re-apply all the styles.
-			[self addDirtyLocation:0 reason:@"brace selection"];
+			if (_braceRight > 0 && _braceRight < length)
+			{
+				[layout addTemporaryAttributes:_braceAttrs forCharacterRange:NSMakeRange(_braceLeft, 1)];
+				[layout addTemporaryAttributes:_braceAttrs forCharacterRange:NSMakeRange(_braceRight, 1)];
+			}
 		}
 	}
 }
 
-// This is about 50x faster than re-applying the runs.
-- (void)_skipApplied:(StyleRuns*)runs
+- (void)_removeBraceHighlight:(NSLayoutManager*)layout length:(NSUInteger)length
 {
-	double startTime = getTime();
-	
-	__block NSUInteger numApplied = 0;
-	[runs process:
-		 ^(NSUInteger elementIndex, id style, NSRange range, bool* stop)
-		 {
-			 (void) style;
-			 
-             NSUInteger loc = self->_appliedRuns.data[numApplied].range.location;
-             NSUInteger len = self->_appliedRuns.data[numApplied].range.length;
-             if (numApplied < self->_appliedRuns.count &&
-                 self->_appliedRuns.data[numApplied].elementIndex == elementIndex &&
-				 loc == range.location && len == range.length &&
-                 (self->_braceRight == 0 || loc + len < self->_braceLeft))
-			 {
-				 ++numApplied; 
-			 }
-			 else
-			 {
-                 setSizeStyleRunVector(&self->_appliedRuns, numApplied);
-				 *stop = true;
-			 }
-		 }
-	 ];
-	
-	double elapsed = getTime() - startTime;
-	LOG("Text:Styler:Verbose", "Skipped %lu runs (%.0fK runs/sec)", numApplied, (numApplied/1000.0)/elapsed);
+	if (_braceRight > 0 && _braceRight < length)
+	{
+		[layout removeTemporaryAttribute:NSBackgroundColorAttributeName forCharacterRange:NSMakeRange(_braceLeft, 1)];
+		[layout removeTemporaryAttribute:NSBackgroundColorAttributeName forCharacterRange:NSMakeRange(_braceRight, 1)];
+	}
 }
 
-- (void)_applyRuns:(StyleRuns*)runs
+// This is called while the storage is processing the edit, before the layout manager
+// has been told about it, so the temporary attributes are still where they were before
+// the edit. The selection change which follows the edit will highlight the braces again.
+- (void)_editedBraces:(NSRange)range delta:(NSInteger)delta
 {
-	// Corresponds to 4K runs on an early 2009 Mac Pro.
-	const double MaxProcessTime = 0.050;
+	UNUSED(range);
 	
-	TextController* tmp = _controller;
-	if (tmp)
+	if (_braceRight > 0)
 	{
-        AppDelegate* app = (AppDelegate*) [NSApp delegate];
-		NSTextStorage* storage = tmp.textView.textStorage;
-        NSDictionary* elementHooks = app.applyElementHooks;
-		double startTime = getTime();
-			
-		__block NSUInteger count = 0;
-		__block NSUInteger beginLoc = 0;
-		__block NSUInteger endLoc = 0;
-		__block NSUInteger lastLoc = 0;
-		[storage beginEditing];
-		[runs process:
-			^(NSUInteger elementIndex, id style, NSRange range, bool* stop)
+		TextController* tmp = _controller;
+		NSLayoutManager* layout = tmp.textView.layoutManager;
+		NSUInteger length = tmp.textView.textStorage.length;
+		NSUInteger oldLength = (NSUInteger) ((NSInteger) length - delta);
+		
+		[self _removeBraceHighlight:layout length:MIN(length, oldLength)];
+		_braceLeft = 0;
+		_braceRight = 0;
+	}
+}
+
+// Element hooks are looked up once per element instead of once per run.
+- (void)_applyElementHooks:(NSDictionary*)elementHooks runs:(StyleRuns*)runs range:(NSRange)range
+{
+	if (elementHooks.count > 0)
+	{
+		TextController* tmp = _controller;
+		NSMutableDictionary* hooksFor = [NSMutableDictionary new];	// element index => hooks (or NSNull)
+		[runs processRange:range block:
+			^(NSUInteger elementIndex, id style, NSRange runRange, bool* stop)
 			{
-				(void) elementIndex;
+				UNUSED(style, stop);
 				
-				if (beginLoc == 0)
-					beginLoc = range.location;
+				id hooks = hooksFor[@(elementIndex)];
+				if (!hooks)
+				{
+					hooks = elementHooks[[runs indexToName:elementIndex]];
+					if (!hooks)
+						hooks = [NSNull null];
+					hooksFor[@(elementIndex)] = hooks;
+				}
 				
-				lastLoc = range.location + range.length;
-                if (lastLoc < self->_firstDirtyLoc)
+				if (hooks != [NSNull null] && runRange.length > 0)
 				{
-					[storage removeAttribute:NSBackgroundColorAttributeName range:range];
-					[storage removeAttribute:NSLinkAttributeName range:range];
-					[storage removeAttribute:NSToolTipAttributeName range:range];
-					
-					[self _applyStyle:style index:elementIndex range:range storage:storage];
-                    
-                    if (elementHooks.count > 0)
-                    {
-                        NSString* elementName = [runs indexToName:elementIndex];
-                        NSArray* hooks = elementHooks[elementName];
-                        for (TextRangeBlock block in hooks)
-                        {
-                            block(tmp, range);
-                        }
-                    }
-					endLoc = range.location + range.length;
-					
-					if (++count % 1000 == 0 && (getTime() - startTime) > MaxProcessTime)
+					for (TextRangeBlock block in (NSArray*) hooks)
 					{
-						*stop = true;
+						block(tmp, runRange);
 					}
 				}
-				else
-				{
-					*stop = true;
-				}
 			}
 		];
-        if (endLoc > beginLoc)
-        {
-            [self _applyBraceStylesAt:beginLoc length:endLoc-beginLoc storage:storage];
-            [self _applyGlyphStylesAt:beginLoc length:endLoc-beginLoc storage:storage];
-
-            if (elementHooks.count > 0)
-            {
-                NSRange range = NSMakeRange(beginLoc, endLoc-beginLoc);
-                NSArray* hooks = elementHooks[@"*"];
-                for (TextRangeBlock block in hooks)
-                {
-                    block(tmp, range);
-                }
-            }
-        }
-		[storage endEditing];
-		
-		double elapsed = getTime() - startTime;
-		if (lastLoc >= _firstDirtyLoc)
-		{
-			// If the user has done an edit there is a very good chance he'll do another
-			// so defer queuing up another styler task.
-			if (count > 0)
-				LOG("Text:Styler:Verbose", "Applied %lu dirty runs (%.0fK runs/sec)", count, (count/1000.0)/elapsed);
-			_queued = false;
-			
-			TextController* tmp = _controller;
-            [tmp resetTypingAttributes];
-			
-			dispatch_queue_t main = dispatch_get_main_queue();
-			dispatch_time_t delay = dispatch_time(DISPATCH_TIME_NOW, 100*NSEC_PER_MSEC);	// 0.1s
-            dispatch_after(delay, main, ^{if (!self->_queued) [self addDirtyLocation:self->_firstDirtyLoc reason:@"still dirty"];});
-		}
-		else if (runs.length)
-		{
-			LOG("Text:Styler:Verbose", "Applied %lu runs (%.0fK runs/sec)", count, (count/1000.0)/elapsed);
-			dispatch_queue_t main = dispatch_get_main_queue();
-			dispatch_async(main, ^{[self _applyRuns:runs];});
-		}
-		else
-		{
-			LOG("Text:Styler:Verbose", "Applied last %lu runs (%.0fK runs/sec)", count, (count/1000.0)/elapsed);
-            [tmp onAppliedStyles];
-			_queued = false;
-		}
-		if (count > 0)
-			_applied = true;
 	}
 }
 
-- (void)_applyStyle:(id)style index:(NSUInteger)index range:(NSRange)range storage:(NSTextStorage*)storage
+// Styles which apply to ranges of text instead of to individual runs.
+- (void)_applyRangeStylesAt:(NSUInteger)location length:(NSUInteger)length hooks:(NSDictionary*)elementHooks storage:(NSTextStorage*)storage
 {
-	if (range.location + range.length > storage.length)	// can happen if the text is edited
-		return;
-	if (range.length == 0)
-		return;
+	[self _applyGlyphStylesAt:location length:length storage:storage];
 	
-	pushStyleRunVector(&_appliedRuns, (struct StyleRun) {.elementIndex = index, .range = range});
-	[storage addAttributes:style range:range];
-}
-
-- (void)_applyBraceStylesAt:(NSUInteger)location length:(NSUInteger)length storage:(NSTextStorage*)storage
-{
-    if (_braceRight > 0)
-    {
-        if (location <= _braceLeft && _braceLeft < location + length)
-            [storage addAttributes:_braceAttrs range:NSMakeRange(_braceLeft, 1)];
-        
-        if (location <= _braceRight && _braceRight < location + length)
-            [storage addAttributes:_braceAttrs range:NSMakeRange(_braceRight, 1)];
-    }
+	if (elementHooks.count > 0)
+	{
+		TextController* tmp = _controller;
+		NSRange range = NSMakeRange(location, length);
+		NSArray* hooks = elementHooks[@"*"];
+		for (TextRangeBlock block in hooks)
+		{
+			block(tmp, range);
+		}
+	}
 }
 
+// The glyph runs were computed by the styler task so all we need to do here is apply
+// the ones within the range.
 - (void)_applyGlyphStylesAt:(NSUInteger)location length:(NSUInteger)length storage:(NSTextStorage*)storage
 {
-    TextController* tmp = _controller;
-    if (tmp)
-    {
-        // Mapping often want to operate on entire lines so we'll ensure that the range is a full line
-        // (NSMatchingWithTransparentBounds isn't sufficient).
-        while (location > 0 && [storage.string characterAtIndex:location] != '\n')
-            --location;
-        
-        while (location + length < storage.length && [storage.string characterAtIndex:location + length - 1] != '\n')
-            ++length;
-        
-        LOG("Text:Styler:Verbose", "removing from (%lu, %lu)", (unsigned long)location, (unsigned long)length);
-        [storage removeAttribute:GlyphsAttributeName range:NSMakeRange(location, length)];
-        
-        for (CharacterMapping* mapping in tmp.charMappings)
-        {
-            [mapping.regex enumerateMatchesInString:storage.string options:NSMatchingWithTransparentBounds range:NSMakeRange(location, length) usingBlock:^(NSTextCheckingResult *match, NSMatchingFlags flags, BOOL *stop)
-             {
-                 UNUSED(flags, stop);
-                 
-                 NSRange range = [match rangeAtIndex:mapping.regex.numberOfCaptureGroups];
-                 LOG("Text:Styler:Verbose", "   adding to (%lu, %lu)", (unsigned long)range.location, (unsigned long)range.length);
-
-                 NSDictionary* style = [tmp.styles attributesForElement:mapping.style];
-                 [storage addAttributes:style range:range];
-                 
-                 [storage addAttributes:@{GlyphsAttributeName:mapping.glyphs} range:range];
-             }];
-        }
-        
-        // These are very awkward to handle via a regex so instead of using an extension we simply
-        // hard-code them.
-        if (tmp.showingLeadingTabs)
-            [self _applyLeadingTabGlyphsAt:location length:length controller:tmp];
-
-        if (tmp.showingNonLeadingTabs)
-            [self _applyNonLeadingTabGlyphsAt:location length:length controller:tmp];
-        
-        if (tmp.showingLeadingSpaces)
-            [self _applyLeadingSpaceGlyphsAt:location length:length controller:tmp];
-        
-        if (tmp.showingLongLines)
-            [self _applyLongLineStyleAt:location length:length controller:tmp];
-    }
-}
-
-- (void)_applyLeadingTabGlyphsAt:(NSUInteger)location length:(NSUInteger)length controller:(TextController*)controller
-{
-    NSDictionary* style = [controller.styles attributesForElement:@"warning"];
-    GlyphsAttribute* glyphs = [[GlyphsAttribute alloc] initWithStyle:style chars:@"\u279C" repeat:true];    // HEAVY ROUND-TIPPED RIGHTWARDS ARROW
-    
-    NSUInteger offset = 0;
-    while (offset < length)
-    {
-        if (location + offset == 0 || [controller.text characterAtIndex:location + offset - 1] == '\n')   // note that Mimsy always uses Unix line endings internally
-        {
-            while (offset < length)
-            {
-                unichar ch = [controller.text characterAtIndex:location + offset];
-                if (ch == '\t')
-                {
-                    NSUInteger start = location + offset;
-                    while (offset < length && ch == '\t')
-                    {
-                        ++offset;
-                        ch = [controller.text characterAtIndex:location + offset];
-                    }
-                    
-                    NSRange range = NSMakeRange(start, location + offset - start);
-                    [controller.textView.textStorage addAttributes:style range:range];
-                    
-                    [controller.textView.textStorage removeAttribute:GlyphsAttributeName range:range];
-                    [controller.textView.textStorage addAttributes:@{GlyphsAttributeName:glyphs} range:range];
-                }
-                else if (ch == ' ')
-                {
-                    ++offset;
-                }
-                else
-                {
-                    ++offset;
-                    break;
-                }
-            }
-        }
-        else
-        {
-            ++offset;
-        }
-    }
-}
-
-- (void)_applyNonLeadingTabGlyphsAt:(NSUInteger)location length:(NSUInteger)length controller:(TextController*)controller
-{
-    NSDictionary* style = [controller.styles attributesForElement:@"warning"];
-    GlyphsAttribute* glyphs = [[GlyphsAttribute alloc] initWithStyle:style chars:@"\u279C" repeat:true];    // HEAVY ROUND-TIPPED RIGHTWARDS ARROW
+    // Mapping often want to operate on entire lines so we'll ensure that the range is a full line.
+    NSRange range = [storage.string lineRangeForRange:NSMakeRange(location, length)];
     
-    NSUInteger offset = 0;
-    while (offset < length)
-    {
-        unichar ch = [controller.text characterAtIndex:location + offset];
-        if (ch == '\t')
-        {
-            if (location + offset == 0 || [controller.text characterAtIndex:location + offset - 1] == '\n')   // note that Mimsy always uses Unix line endings internally
-            {
-                while (offset < length && ch == '\t')
-                {
-                    ++offset;
-                    ch = [controller.text characterAtIndex:location + offset];
-                }
-            }
-            else
-            {
-                NSUInteger start = location + offset;
-                while (offset < length && ch == '\t')
-                {
-                    ++offset;
-                    ch = [controller.text characterAtIndex:location + offset];
-                }
-                
-                NSRange range = NSMakeRange(start, location + offset - start);
-                [controller.textView.textStorage addAttributes:style range:range];
-                
-                [controller.textView.textStorage removeAttribute:GlyphsAttributeName range:range];
-                [controller.textView.textStorage addAttributes:@{GlyphsAttributeName:glyphs} range:range];
-            }
-            
-        }
-        else
-        {
-            ++offset;
-        }
-    }
-}
-
-- (void)_applyLeadingSpaceGlyphsAt:(NSUInteger)location length:(NSUInteger)length controller:(TextController*)controller
-{
-    NSDictionary* style = [controller.styles attributesForElement:@"warning"];
-    GlyphsAttribute* glyphs = [[GlyphsAttribute alloc] initWithStyle:style chars:@"\u2022" repeat:true];    // BULLET
-    
-    NSUInteger offset = 0;
-    while (offset < length)
-    {
-        NSUInteger lineStart = location + offset;
-        if (lineStart == 0 || [controller.text characterAtIndex:lineStart - 1] == '\n')   // note that Mimsy always uses Unix line endings internally
-        {
-            while (offset < length)
-            {
-                unichar ch = [controller.text characterAtIndex:location + offset];
-                if (ch == '\t')
-                {
-                    ++offset;
-                }
-                else if (ch == ' ')
-                {
-                    NSUInteger start = location + offset;
-                    while (offset < length && ch == ' ')
-                    {
-                        ++offset;
-                        if (location + offset < controller.text.length)
-                            ch = [controller.text characterAtIndex:location + offset];
-                        else
-                            ch = '\x0';
-                    }
-                    
-                    // Allow leading spaces before multi-line C-style comments.
-                    if (ch != '*')
-                    {
-                        // We highlight spaces at the very start of a line and spaces between tabs,
-                        // but not spaces following tabs.
-                        if (start == lineStart || ch == '\t')
-                        {
-                            NSRange range = NSMakeRange(start, location + offset - start);
-                            [controller.textView.textStorage addAttributes:style range:range];
-                            
-                            [controller.textView.textStorage removeAttribute:GlyphsAttributeName range:range];
-                            [controller.textView.textStorage addAttributes:@{GlyphsAttributeName:glyphs} range:range];
-                        }
-                    }
-                }
-                else
-                {
-                    ++offset;
-                    break;
-                }
-            }
-        }
-        else
-        {
-            ++offset;
-        }
-    }
-}
-
-- (void)_applyLongLineStyleAt:(NSUInteger)location length:(NSUInteger)length controller:(TextController*)controller
-{
-    unsigned int tabWidth = (unsigned int) [controller.layeredSettings intValue:@"TabWidth" missing:4];
-    int maxWidth = [controller.layeredSettings intValue:@"MaxLineWidth" missing:80];
-    bool useTabWidth = [controller.layeredSettings boolValue:@"LongLineIncludesTabWidth" missing:false];
-    
-    NSUInteger offset = 0;
-    while (offset < length)
-    {
-        NSUInteger lineStart = location + offset;
-        if (lineStart == 0 || [controller.text characterAtIndex:lineStart - 1] == '\n')   // note that Mimsy always uses Unix line endings internally
-        {
-            NSUInteger longStart = 0;
-            NSUInteger length = 0;
-            while (location + offset < controller.text.length)
-            {
-                unichar ch = [controller.text characterAtIndex:location+offset];
-                ++offset;
-
-                if (ch == '\n')
-                {
-                   break;
-                }
-                else
-                {
-                    if (ch == '\t' && useTabWidth)
-                        length += tabWidth;
-                    else
-                        length += 1;
-                    
-                    if (length > maxWidth && longStart == 0)
-                        longStart = location + offset - 1;
-                }
-            }
-            
-            if (longStart > 0)
-            {
-                NSRange range = NSMakeRange(longStart, location + offset - longStart);
-                [controller.textView.textStorage removeAttribute:NSForegroundColorAttributeName range:range];
-                [controller.textView.textStorage addAttributes:@{NSForegroundColorAttributeName:[NSColor redColor]} range:range];
-            }
-        }
-        else
-        {
-            ++offset;
-        }
-    }
+    LOG("Text:Styler:Verbose", "removing from (%lu, %lu)", (unsigned long)range.location, (unsigned long)range.length);
+    [storage removeAttribute:GlyphsAttributeName range:range];
+    [_lastGlyphs applyTo:storage range:range];
 }
 
 @end
@@ -1,14 +1,40 @@
 #import <Foundation/Foundation.h>
+#import "MimsyPlugins.h"
 
-@class Language, StyleRuns;
+@class GlyphRuns, GlyphScanner, Language, StyleRuns;
 
-typedef void (^StylesCompleted)(StyleRuns* runs);
+typedef void (^StylesCompleted)(StyleRuns* runs, GlyphRuns* glyphs);
+
+/// Used to abandon a styler task once the text it is styling has been edited.
+@interface StylerToken : NSObject
+
+- (id)initWithEditCount:(NSUInteger)count;
+
+/// The version of the document the task is styling.
+@property (readonly) NSUInteger editCount;
+
+/// Called from the main thread.
+- (void)cancel;
+
+/// Polled by the styler thread(s).
+@property (readonly) bool cancelled;
+
+@end
 
 /// This is the entry point that kicks off a task used to compute
 /// styles for a text document using a specified language.
 @interface AsyncStyler : NSObject
 
-/// The completion handler is called on the main thread.
-+ (void)computeStylesFor:(Language*)lang withText:(NSString*)text editCount:(NSUInteger)count completion:(StylesCompleted)callback;
+/// The completion handler is called on the main thread. If previous is set then
+/// edited and delta describe the changes made to the text since previous was computed
+/// and only the text around the edit will be re-lexed. The glyph runs are computed
+/// at the same time using scanner (previousGlyphs should be from the same version of
+/// the text as previous). If the token is cancelled while the task runs the callback
+/// is called with nil.
++ (void)computeStylesFor:(Language*)lang glyphs:(GlyphScanner*)scanner withText:(NSString*)text editCount:(NSUInteger)count previous:(StyleRuns*)previous previousGlyphs:(GlyphRuns*)previousGlyphs edited:(NSRange)edited delta:(NSInteger)delta token:(StylerToken*)token completion:(StylesCompleted)callback;
+
+/// Like the above except that the runs cached for path are used if they're still valid
+/// (if not all of the text is styled). This is used when an unedited document is opened.
++ (void)loadStylesFor:(Language*)lang path:(MimsyPath*)path glyphs:(GlyphScanner*)scanner withText:(NSString*)text editCount:(NSUInteger)count token:(StylerToken*)token completion:(StylesCompleted)callback;
 
 @end
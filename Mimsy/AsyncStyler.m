@@ -1,11 +1,54 @@
 #import "AsyncStyler.h"
 
+#import <stdatomic.h>
+
+#import "GlyphScanner.h"
 #import "Language.h"
+#import "Logger.h"
 #import "RegexStyler.h"
+#import "StyleCache.h"
+
+// Documents at least twice this size are styled using multiple cores.
+static const NSUInteger MinChunkSize = 128*1024;
+
+@implementation StylerToken
+{
+	atomic_bool _cancelled;
+}
+
+- (id)initWithEditCount:(NSUInteger)count
+{
+	_editCount = count;
+	atomic_init(&_cancelled, false);
+	return self;
+}
+
+- (void)cancel
+{
+	atomic_store(&_cancelled, true);
+}
+
+// threaded
+- (bool)cancelled
+{
+	return atomic_load_explicit(&_cancelled, memory_order_relaxed);
+}
+
+@end
+
+// threaded
+static StyleRuns* computeAll(Language* lang, NSString* text, NSUInteger count, StylerToken* token)
+{
+	NSUInteger chunks = MIN([NSProcessInfo processInfo].activeProcessorCount, text.length/MinChunkSize);
+	if (chunks > 1)
+		return [lang.styler computeStyles:text editCount:count chunks:chunks token:token];
+	else
+		return [lang.styler computeStyles:text editCount:count token:token];
+}
 
 @implementation AsyncStyler
 
-+ (void)computeStylesFor:(Language*)lang withText:(NSString*)text editCount:(NSUInteger)count completion:(StylesCompleted)callback
++ (void)computeStylesFor:(Language*)lang glyphs:(GlyphScanner*)scanner withText:(NSString*)text editCount:(NSUInteger)count previous:(StyleRuns*)previous previousGlyphs:(GlyphRuns*)previousGlyphs edited:(NSRange)edited delta:(NSInteger)delta token:(StylerToken*)token completion:(StylesCompleted)callback
 {
 	// We're processing the text using a task so we need to ensure that
 	// no one is changing the text as we process it. Note that in the
@@ -17,8 +60,51 @@
 	dispatch_queue_t main = dispatch_get_main_queue();	
 	dispatch_async(concurrent,
 		^{
-			StyleRuns* runs = [lang.styler computeStyles:text editCount:count];
-			dispatch_async(main, ^{callback(runs);});
+			// Glyphs are scanned for while the text is being styled.
+			__block GlyphRuns* glyphs = nil;
+			dispatch_group_t group = dispatch_group_create();
+			dispatch_group_async(group, concurrent, ^{glyphs = [scanner scan:text previous:previousGlyphs edited:edited delta:delta token:token];});
+			
+			StyleRuns* runs = nil;
+			if (previous)
+				runs = [lang.styler computeStyles:text editCount:count previous:previous edited:edited delta:delta token:token];
+			if (!runs && !token.cancelled)
+				runs = computeAll(lang, text, count, token);
+			dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+			if (token.cancelled)
+			{
+				LOG("Text:Styler:Verbose", "Cancelled styling edit %lu", count);
+				runs = nil;
+				glyphs = nil;
+			}
+			dispatch_async(main, ^{callback(runs, glyphs);});
+		});
+}
+
++ (void)loadStylesFor:(Language*)lang path:(MimsyPath*)path glyphs:(GlyphScanner*)scanner withText:(NSString*)text editCount:(NSUInteger)count token:(StylerToken*)token completion:(StylesCompleted)callback
+{
+	text = [text copy];
+	
+	dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	dispatch_queue_t main = dispatch_get_main_queue();
+	dispatch_async(concurrent,
+		^{
+			__block GlyphRuns* glyphs = nil;
+			dispatch_group_t group = dispatch_group_create();
+			dispatch_group_async(group, concurrent, ^{glyphs = [scanner scan:text previous:nil edited:NSMakeRange(0, 0) delta:0 token:token];});
+			
+			// Validating the cached runs is O(N) so it's done here instead of on the main thread.
+			StyleRuns* runs = [StyleCache loadRuns:path language:lang length:text.length editCount:count];
+			if (!runs && !token.cancelled)
+				runs = computeAll(lang, text, count, token);
+			dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+			if (token.cancelled)
+			{
+				LOG("Text:Styler:Verbose", "Cancelled styling edit %lu", count);
+				runs = nil;
+				glyphs = nil;
+			}
+			dispatch_async(main, ^{callback(runs, glyphs);});
 		});
 }
 
@@ -25,6 +25,10 @@
 @property (readonly) Glob* includeGlobs;
 @property (readonly) double startTime;
 
+/// Number of files which have been found but not yet processed.
 @property int numFilesLeft;
 
+/// Set once every file has been processed (just before _onFinish is called).
+@property (readonly) bool finished;
+
 @end
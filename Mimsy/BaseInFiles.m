@@ -7,14 +7,108 @@
 #import "Languages.h"
 #import "RangeVector.h"
 #import "RegexStyler.h"
+#import "StyleCache.h"
 #import "StyleRuns.h"
 #import "TranscriptController.h"
+#import "TrigramIndex.h"
+#import "WorkQueue.h"
+
+// Limits the number of paths waiting to be searched so that we don't build up a
+// huge list of paths when walking a big tree.
+const NSUInteger MaxQueuedPaths = 1024;
+
+// Limits the memory used by the files the workers are processing at once. This is
+// charged for the decoded text which is UTF-16 so it's up to twice the size of the
+// file. A file which needs more than this is processed by itself.
+const NSUInteger MaxBytesInFlight = 256*1024*1024;
+
+// When searching within an element only the text around the matches is lexed. This
+// is how far before a match the lexing starts.
+const NSUInteger MatchContext = 8*1024;
+
+static NSData* longestLiteral(NSArray* literals)
+{
+	NSData* result = nil;
+	for (NSData* literal in literals)
+	{
+		if (literal.length > result.length)
+			result = literal;
+	}
+	return result;
+}
+
+static uint8_t lowerByte(uint8_t b)
+{
+	return b >= 'A' && b <= 'Z' ? b + ('a' - 'A') : b;
+}
+
+static bool isASCII(const uint8_t* bytes, NSUInteger length)
+{
+	uint8_t bits = 0;
+	for (NSUInteger i = 0; i < length; ++i)
+		bits |= bytes[i];		// no early exit so the compiler can vectorize this
+	return (bits & 0x80) == 0;
+}
+
+// memchr and memmem are vectorized in libc so we lean on them instead of
+// scanning the bytes ourselves.
+static bool containsLiteral(const uint8_t* bytes, NSUInteger length, NSData* literal, bool ignoreCase)
+{
+	const uint8_t* lit = literal.bytes;
+	NSUInteger n = literal.length;
+	if (length < n)
+		return false;
+	
+	if (!ignoreCase)
+		return memmem(bytes, length, lit, n) != NULL;
+	
+	uint8_t lower = lowerByte(lit[0]);
+	uint8_t upper = (uint8_t) toupper(lower);
+	const uint8_t* p = bytes;
+	const uint8_t* last = bytes + length - n;		// last place a match can start
+	while (p <= last)
+	{
+		const uint8_t* candidate = memchr(p, lower, (size_t) (last - p + 1));
+		if (upper != lower)
+		{
+			const uint8_t* other = memchr(p, upper, (size_t) ((candidate ? candidate : last + 1) - p));
+			if (other)
+				candidate = other;
+		}
+		if (!candidate)
+			return false;
+		
+		NSUInteger i = 1;
+		while (i < n && lowerByte(candidate[i]) == lowerByte(lit[i]))
+			++i;
+		if (i == n)
+			return true;
+		
+		p = candidate + 1;
+	}
+	return false;
+}
 
 @implementation BaseInFiles
 {
 	Glob* _excludeGlobs;
 	Glob* _excludeAllGlobs;
     double _startTime;
+	
+	NSUInteger _numWorkers;
+	int32_t _numRunning;
+	NSCondition* _budgetLock;
+	NSUInteger _bytesInFlight;
+	
+	TrigramIndex* _index;		// nil if there is no index or it can't be used with the regex
+	NSData* _asciiTrigrams;
+	NSData* _unicodeTrigrams;
+	int32_t _numSkipped;
+	
+	NSData* _literal;			// bytes every match must contain or nil
+	NSData* _unicodeLiteral;	// as above but for files with non-ASCII bytes
+	bool _ignoreCase;
+	int32_t _numFiltered;
 }
 
 - (id)init:(FindInFilesController*)controller path:(MimsyPath*)path
@@ -36,6 +130,22 @@
         AppDelegate* app = (AppDelegate*) [NSApp delegate];
 		globs = [[app.layeredSettings stringValue:@"FindAllAlwaysExclude" missing:@""] splitByString:@" "];
 		_excludeAllGlobs = [[Glob alloc] initWithGlobs:globs];
+		
+		int threads = [app.layeredSettings intValue:@"FindAllThreads" missing:0];
+		_numWorkers = threads > 0 ? (NSUInteger) threads : [NSProcessInfo processInfo].activeProcessorCount;
+		_budgetLock = [NSCondition new];
+		
+		// If the directory is indexed we can skip the files which can't match.
+		_index = [TrigramIndex indexFor:path];
+		_asciiTrigrams = [TrigramIndex trigramsFor:_regex unicode:false];
+		_unicodeTrigrams = [TrigramIndex trigramsFor:_regex unicode:true];
+		if (!_asciiTrigrams)
+			_index = nil;
+		
+		// Files which don't contain these bytes can be skipped without decoding them.
+		_literal = longestLiteral([TrigramIndex literalsFor:_regex unicode:false]);
+		_unicodeLiteral = longestLiteral([TrigramIndex literalsFor:_regex unicode:true]);
+		_ignoreCase = (_regex.options & NSRegularExpressionCaseInsensitive) != 0;
 	}
 	
 	return self;
@@ -54,23 +164,34 @@
 	ASSERT(false);
 }
 
+// Paths are streamed from the directory walker to a pool of workers through a
+// bounded queue. Each worker reads, decodes, and searches one file at a time so
+// a big file only stalls one worker.
 - (void)_step2FindPaths			// threaded
 {
-	NSMutableArray* paths = [[NSMutableArray alloc] initWithCapacity:256];
 	LOG("Find:Verbose", "Finding paths");
+	WorkQueue* queue = [self _startWorkers];
     
     AppDelegate* app = (AppDelegate*) [NSApp delegate];
-    [app enumerateWithDir:_root recursive:true
+    [app enumerateConcurrentlyWithDir:_root recursive:true
         error:
         ^(NSString* _Nonnull error)
         {
             NSString* mesg = [NSString stringWithFormat:@"Find error:: %@", error];
             [TranscriptController writeError:mesg];
         }
+        dirPredicate:^BOOL(MimsyPath* _Nonnull parent, NSString* _Nonnull name)
+        {
+            // Excluded directories (and everything under them) are skipped without
+            // being read. Aborting skips everything that is left.
+            if (self._aborted)
+                return false;
+            const char* str = [parent appendWithComponent:name].asString.UTF8String;
+            return ![self->_excludeGlobs matchName:name] && ![self->_excludeAllGlobs matchName:name] &&
+                   ![self->_excludeGlobs matchStr:str] && ![self->_excludeAllGlobs matchStr:str];
+        }
         predicate:^BOOL(MimsyPath* _Nonnull dir, NSString* _Nonnull name)
         {
-            // TODO: could speed this up by changing enumerateWithDir to support
-            // directly pruning sub-directories.
             const char* str = dir.asString.UTF8String;
             if (![self->_excludeGlobs matchStr:str] && ![self->_excludeAllGlobs matchStr:str])
                 if ([self->_includeGlobs matchName:name])
@@ -79,53 +200,96 @@
         }
         callback:^(MimsyPath* _Nonnull dir, NSArray<NSString*>* _Nonnull names)
         {
-            for (NSString* name in names)
+            for (NSUInteger i = 0; i < names.count && !self._aborted; ++i)
             {
-                MimsyPath* path = [dir appendWithComponent:name];
-                [paths addObject:path];
+                MimsyPath* path = [dir appendWithComponent:names[i]];
+                if (!self->_index || [self->_index mayMatch:path ascii:self->_asciiTrigrams unicode:self->_unicodeTrigrams])
+                    [self _queuePath:path queue:queue];
+                else
+                    OSAtomicIncrement32(&self->_numSkipped);
             }
         }];
 	
-	_numFilesLeft = (int) paths.count;
-	if (paths.count > 0)
-		[self _step3QueuePaths:paths];
-	else
-		[self _onFinish];
+	if (_index)
+		LOG("Find", "Trigram index skipped %d files", _numSkipped);
+	[queue close];
 }
 
 - (void)_step3QueuePaths:(NSMutableArray*)paths		// sometimes threaded
 {
-	ASSERT(paths.count > 0);
-	NSUInteger middle = paths.count/2;
 	LOG("Find:Verbose", "Queuing %lu paths", paths.count);
 	
-	// We process the files using two threads so one can be reading from the hard
-	// drive while the other is processing its file.
+	WorkQueue* queue = [self _startWorkers];
+	for (MimsyPath* path in paths)
+		[self _queuePath:path queue:queue];
+	[queue close];
+}
+
+- (void)_queuePath:(MimsyPath*)path queue:(WorkQueue*)queue	// threaded
+{
+	OSAtomicIncrement32Barrier(&_numFilesLeft);
+	[queue push:path];
+}
+
+- (WorkQueue*)_startWorkers	// threaded
+{
+	LOG("Find:Verbose", "Starting %lu workers", _numWorkers);
+	WorkQueue* queue = [[WorkQueue alloc] initWithCapacity:MaxQueuedPaths];
+	
+	_numRunning = (int32_t) _numWorkers;
 	dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-	dispatch_async(concurrent,
-	   ^{
-		   [self _step4ProcessPaths:paths begin:0 end:middle];
-	   });
-	dispatch_async(concurrent,
-	   ^{
-		   [self _step4ProcessPaths:paths begin:middle end:paths.count];
-	   });
+	for (NSUInteger i = 0; i < _numWorkers; ++i)
+	{
+		dispatch_async(concurrent,
+		   ^{
+			   [self _step4ProcessPaths:queue];
+		   });
+	}
+	
+	return queue;
 }
 
-- (void)_step4ProcessPaths:(NSArray*)paths begin:(NSUInteger)begin end:(NSUInteger)end	// threaded
+- (void)_step4ProcessPaths:(WorkQueue*)queue	// threaded
 {
-	LOG("Find:Verbose", "Processing %lu paths", end - begin);
-	for (NSUInteger i = begin; i < end && !self._aborted; ++i)
+	MimsyPath* path;
+	while ((path = [queue pop]))
 	{
-		MimsyPath* path = paths[i];
-		NSString* errStr = nil;
-		const char* op = "reading";
-		
-		NSError* error = nil;
+		if (!self._aborted)
+			[self _processFile:path];
 		OSAtomicDecrement32Barrier(&_numFilesLeft);
-		NSData* data = [NSData dataWithContentsOfFile:path.asString options:0 error:&error];
-		if (data)
+	}
+	
+	// The queue is only drained once the walker is done so the last worker out
+	// knows that every file has been processed.
+	if (OSAtomicDecrement32Barrier(&_numRunning) == 0)
+	{
+		if (_literal)
+			LOG("Find", "Literal prefilter skipped %d files", _numFiltered);
+		_finished = true;
+		[self _onFinish];
+	}
+}
+
+- (void)_processFile:(MimsyPath*)path	// threaded
+{
+	NSString* errStr = nil;
+	const char* op = "reading";
+	
+	@autoreleasepool
+	{
+		// Mapping the file means that files which the prefilter rejects are only
+		// paged in as far as needed and don't count against MaxBytesInFlight.
+		NSError* error = nil;
+		NSData* data = [NSData dataWithContentsOfFile:path.asString options:NSDataReadingMappedIfSafe error:&error];
+		if (data && ![self _mayMatch:data])
 		{
+			OSAtomicIncrement32(&_numFiltered);
+		}
+		else if (data)
+		{
+			// The decoded text has at most one UTF-16 code unit per byte.
+			NSUInteger bytes = [self _reserveBytes:data.length*sizeof(unichar)];
+			
 			op = "decoding";
 			Decode* decoded = [[Decode alloc] initWithData:data];
 			if (decoded.text)
@@ -140,47 +304,108 @@
 			}
 			else
 				errStr = decoded.error;
+			
+			[self _releaseBytes:bytes];
 		}
 		else
 		{
 			errStr = [error localizedFailureReason];
 		}
-		
-		if (errStr)
-		{
-			dispatch_queue_t main = dispatch_get_main_queue();
-			dispatch_async(main,
-			   ^{
-				   NSString* mesg = [NSString stringWithFormat:@"Error %s '%@': %@", op, path, errStr];
-				   [TranscriptController writeError:mesg];
-			   });
-		}
 	}
 	
-	if (_numFilesLeft == 0)
-		[self _onFinish];
+	if (errStr)
+	{
+		dispatch_queue_t main = dispatch_get_main_queue();
+		dispatch_async(main,
+		   ^{
+			   NSString* mesg = [NSString stringWithFormat:@"Error %s '%@': %@", op, path, errStr];
+			   [TranscriptController writeError:mesg];
+		   });
+	}
+}
+
+// Returns false if the file's bytes show that the regex cannot match. This has
+// to agree with Decode: ASCII bytes decode to the same characters unless the file
+// is UTF-16 or UTF-32 and Decode only considers those if the start of the file
+// has a BOM or zero bytes.
+- (bool)_mayMatch:(NSData*)data	// threaded
+{
+	if (!_literal)
+		return true;
+	
+	const uint8_t* bytes = data.bytes;
+	NSUInteger length = data.length;
+	if (memchr(bytes, 0, MIN(length, 128)))
+		return true;
+	if (length >= 2 && ((bytes[0] == 0xFE && bytes[1] == 0xFF) || (bytes[0] == 0xFF && bytes[1] == 0xFE)))
+		return true;
+	
+	if (containsLiteral(bytes, length, _literal, _ignoreCase))
+		return true;
+	
+	// Case insensitive matches of some ASCII letters can match ligatures and
+	// symbols like the Kelvin sign.
+	if (_ignoreCase && !isASCII(bytes, length))
+		return !_unicodeLiteral || containsLiteral(bytes, length, _unicodeLiteral, true);
+	
+	return false;
+}
+
+// Blocks until bytes fits within MaxBytesInFlight. Returns the number of bytes
+// which were reserved.
+- (NSUInteger)_reserveBytes:(NSUInteger)bytes	// threaded
+{
+	bytes = MIN(bytes, MaxBytesInFlight);
+	
+	[_budgetLock lock];
+	while (_bytesInFlight + bytes > MaxBytesInFlight)
+		[_budgetLock wait];
+	_bytesInFlight += bytes;
+	[_budgetLock unlock];
+	
+	return bytes;
+}
+
+- (void)_releaseBytes:(NSUInteger)bytes	// threaded
+{
+	[_budgetLock lock];
+	_bytesInFlight -= bytes;
+	[_budgetLock broadcast];
+	[_budgetLock unlock];
 }
 
 - (bool)_processPath:(MimsyPath*)path withContents:(NSMutableString*)contents	// threaded
 {
 	NSMutableArray* matches = [NSMutableArray new];
 	
-	struct RangeVector* ranges = [self _findRangesForStyle:_searchWithin path:path contents:contents];
-
 	NSRange range = NSMakeRange(0, contents.length);
 	[_regex enumerateMatchesInString:contents options:0 range:range usingBlock:
 		 ^(NSTextCheckingResult *match, NSMatchingFlags flags, BOOL *stop)
 		 {
 			 UNUSED(flags, stop);
 			 
-			 if (match && [self _shouldProcessRange:match.range inRanges:ranges])
+			 if (match)
 				 [matches addObject:match];
 		 }];
 	
-	if (ranges)
+	// Styling is a lot slower than matching so we only style files which have
+	// matches (and then only the text around the matches).
+	if (matches.count > 0)
 	{
-		freeRangeVector(ranges);
-		free(ranges);
+		struct RangeVector* ranges = [self _findRangesForStyle:_searchWithin path:path contents:contents matches:matches];
+		if (ranges)
+		{
+			NSMutableArray* within = [NSMutableArray new];
+			for (NSTextCheckingResult* match in matches)
+			{
+				if ([self _shouldProcessRange:match.range inRanges:ranges])
+					[within addObject:match];
+			}
+			matches = within;
+			
+			freeRangeVector(ranges);
+			free(ranges);
+		}
 	}
 	
 	bool edited = [self _processMatches:matches forPath:path withContents:contents];
@@ -188,7 +413,7 @@
 	return edited;
 }
 
-- (struct RangeVector*)_findRangesForStyle:(NSString*)styleName path:(MimsyPath*)path contents:(NSString*)contents
+- (struct RangeVector*)_findRangesForStyle:(NSString*)styleName path:(MimsyPath*)path contents:(NSString*)contents matches:(NSArray*)matches
 {
 	__block struct RangeVector* ranges = NULL;
 	
@@ -200,7 +425,19 @@
 		Language* language = [Languages findWithFileName:path.lastComponent contents:contents];
 		if (language && language.styler)
 		{
-			StyleRuns* runs = [language.styler computeStyles:contents editCount:0];
+			// If the file was open recently the runs for all of it may be cached.
+			StyleRuns* runs = [StyleCache loadRuns:path language:language length:contents.length editCount:0];
+			if (!runs)
+			{
+				struct RangeVector hits = newRangeVector();
+				reserveRangeVector(&hits, matches.count);
+				for (NSTextCheckingResult* match in matches)
+					pushRangeVector(&hits, match.range);
+				
+				runs = [language.styler computeStyles:contents near:&hits context:MatchContext];
+				freeRangeVector(&hits);
+			}
+			
 			NSUInteger styleIndex = [runs nameToIndex:styleName];
 			if (styleIndex != NSNotFound)
 			{
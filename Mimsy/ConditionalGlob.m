@@ -1,12 +1,13 @@
 #import "ConditionalGlob.h"
 
-#import <fnmatch.h>
+#import "GlobMatcher.h"
 #import "Logger.h"
 
 @implementation ConditionalGlob
 {
 	NSArray* _regexen;
 	NSArray* _conditionals;
+	NSArray* _conditionalMatchers;
 }
 
 - (id)initWithGlob:(NSString*)glob
@@ -29,6 +30,7 @@
 	{
 		_regexen = regexen;
 		_conditionals = conditionals;
+		_conditionalMatchers = [conditionals map:^id(NSString* glob) {return [[GlobMatcher alloc] initWithGlobs:@[glob]];}];
 	}
 	
 	return self;
@@ -36,9 +38,11 @@
 
 - (int)matchName:(NSString*)name contents:(NSString*)contents
 {
-	for (NSUInteger i = 0; i < _conditionals.count; ++i)
+	const char* str = name.UTF8String;
+	NSUInteger length = strlen(str);
+	for (NSUInteger i = 0; i < _conditionalMatchers.count; ++i)
 	{
-		if (fnmatch([_conditionals[i] UTF8String], [name UTF8String], FNM_CASEFOLD) == 0)
+		if ([_conditionalMatchers[i] matchBytes:str length:length])
 		{
 			NSTextCheckingResult* match = [_regexen[i] firstMatchInString:contents options:0 range:NSMakeRange(0, contents.length)];
 			if (match && match.range.location != NSNotFound)
@@ -48,7 +52,7 @@
 		}
 	}
 	
-	if ([super matchName:name])
+	if ([super matchStr:str])
 		return 1;
 	
 	return 0;
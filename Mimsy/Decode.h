@@ -12,4 +12,10 @@
 @property (readonly) NSString* error;
 @property (readonly) NSStringEncoding encoding;
 
+/// Counts of the line endings within text. CRLF pairs are only counted as
+/// windows endings.
+@property (readonly) NSUInteger unixEndings;
+@property (readonly) NSUInteger macEndings;
+@property (readonly) NSUInteger windowsEndings;
+
 @end
\ No newline at end of file
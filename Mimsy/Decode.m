@@ -1,5 +1,7 @@
 #import "Decode.h"
 
+#import "Logger.h"
+
 // Returns true if the character is a control character that should not
 // appear in source code.
 static bool isBadControl(unsigned char b)
@@ -113,32 +115,195 @@ static bool all_chars(const unsigned char* buffer, bool (*predicate)(unsigned ch
 	return true;
 }
 
-static NSStringEncoding getEncoding(NSData* data, unsigned long* skipBytes)
+// Bytes which aren't mapped to anything in Windows-1252.
+static bool isCP1252Hole(unsigned char b)
 {
-	NSStringEncoding encoding = 0;
-	const int HeaderBytes = 2*64;
+	return b == 0x81 || b == 0x8D || b == 0x8F || b == 0x90 || b == 0x9D;
+}
+
+// Returns the length of the well formed UTF-8 sequence starting at buffer or 0
+// if it's not well formed. See table 3-7 in the Unicode standard.
+static unsigned long utf8Length(const unsigned char* buffer, unsigned long len)
+{
+	unsigned char b = buffer[0];
+	unsigned long n;
+	unsigned char lo = 0x80, hi = 0xBF;		// range of the second byte
+	
+	if (b >= 0xC2 && b <= 0xDF)
+		n = 2;
+	else if (b >= 0xE0 && b <= 0xEF)
+	{
+		n = 3;
+		if (b == 0xE0)
+			lo = 0xA0;				// overlong
+		else if (b == 0xED)
+			hi = 0x9F;				// surrogates
+	}
+	else if (b >= 0xF0 && b <= 0xF4)
+	{
+		n = 4;
+		if (b == 0xF0)
+			lo = 0x90;				// overlong
+		else if (b == 0xF4)
+			hi = 0x8F;				// > U+10FFFF
+	}
+	else
+		return 0;
 	
-	unsigned char* buffer = alloca(HeaderBytes);
-	[data getBytes:buffer length:HeaderBytes];
-	unsigned long length = MIN([data length], HeaderBytes);
+	if (n > len || buffer[1] < lo || buffer[1] > hi)
+		return 0;
+	
+	for (unsigned long i = 2; i < n; ++i)
+	{
+		if (buffer[i] < 0x80 || buffer[i] > 0xBF)
+			return 0;
+	}
+	
+	return n;
+}
+
+const uint64_t OnesBytes = 0x0101010101010101ULL;
+const uint64_t HighBits = 0x8080808080808080ULL;
+
+// Word must be ASCII. Returns a word with the high bit set in each byte that
+// is equal to ch.
+static uint64_t matchBytes(uint64_t word, unsigned char ch)
+{
+	uint64_t x = word ^ (ch*OnesBytes);
+	uint64_t nonzero = ((x & ~HighBits) + ~HighBits) | x;
+	return ~nonzero & HighBits;
+}
+
+struct Scan
+{
+	NSUInteger lf;				// includes the LFs in CRLFs
+	NSUInteger cr;				// includes the CRs in CRLFs
+	NSUInteger crlf;
+	bool validUTF8;
+	bool hasCP1252Holes;
+};
+
+// Validates all of the text as UTF-8 and counts line endings in one pass. Runs
+// of ASCII are handled eight bytes at a time which, for source code, is nearly
+// everything.
+static void scanBytes(const unsigned char* buffer, unsigned long len, struct Scan* scan)
+{
+	bool lastWasCR = false;
+	unsigned long i = 0;
+	
+	scan->validUTF8 = true;
+	while (i < len)
+	{
+		if (i + sizeof(uint64_t) <= len)
+		{
+			uint64_t word;
+			memcpy(&word, buffer + i, sizeof(word));
+			word = CFSwapInt64LittleToHost(word);	// so byte i is the low byte
+			if ((word & HighBits) == 0)
+			{
+				uint64_t lfs = matchBytes(word, '\n');
+				uint64_t crs = matchBytes(word, '\r');
+				if (lfs | crs)
+				{
+					scan->lf += (NSUInteger) __builtin_popcountll(lfs);
+					scan->cr += (NSUInteger) __builtin_popcountll(crs);
+					scan->crlf += (NSUInteger) __builtin_popcountll(crs & (lfs >> 8));
+					if (lastWasCR && buffer[i] == '\n')
+						scan->crlf += 1;
+				}
+				lastWasCR = buffer[i + sizeof(word) - 1] == '\r';
+				i += sizeof(word);
+				continue;
+			}
+		}
+		
+		unsigned char b = buffer[i];
+		if (b < 0x80)
+		{
+			if (b == '\n')
+			{
+				scan->lf += 1;
+				if (lastWasCR)
+					scan->crlf += 1;
+			}
+			else if (b == '\r')
+			{
+				scan->cr += 1;
+			}
+			lastWasCR = b == '\r';
+			i += 1;
+		}
+		else
+		{
+			unsigned long n = scan->validUTF8 ? utf8Length(buffer + i, len - i) : 0;
+			if (n == 0)
+			{
+				scan->validUTF8 = false;
+				n = 1;
+			}
+			
+			for (unsigned long j = i; j < i + n; ++j)
+				scan->hasCP1252Holes = scan->hasCP1252Holes || isCP1252Hole(buffer[j]);
+			
+			lastWasCR = false;
+			i += n;
+		}
+	}
+}
+
+// Counts line endings for utf-16 and utf-32 text.
+static void scanWide(const unsigned char* buffer, unsigned long len, unsigned long width, bool bigEndian, struct Scan* scan)
+{
+	bool lastWasCR = false;
+	for (unsigned long i = 0; i + width <= len; i += width)
+	{
+		uint32_t unit = 0;
+		for (unsigned long j = 0; j < width; ++j)
+		{
+			unsigned long k = bigEndian ? j : width - j - 1;
+			unit = unit << 8 | buffer[i + k];
+		}
+		
+		if (unit == '\n')
+		{
+			scan->lf += 1;
+			if (lastWasCR)
+				scan->crlf += 1;
+		}
+		else if (unit == '\r')
+		{
+			scan->cr += 1;
+		}
+		lastWasCR = unit == '\r';
+	}
+}
+
+// Only the first few bytes are used to detect utf-16 and utf-32 but the whole
+// file is scanned when deciding between utf-8 and the legacy encodings so that
+// NSString is only asked to decode the data once.
+static NSStringEncoding getEncoding(const unsigned char* buffer, unsigned long len, unsigned long* skipBytes, struct Scan* scan)
+{
+	NSStringEncoding encoding = 0;
+	const unsigned long HeaderBytes = 2*64;
+	unsigned long length = MIN(len, HeaderBytes);
 		
 	// Check for a BOM.
-	if (buffer[0] == 0x00 && buffer[1] == 0x00 && buffer[2] == 0xFE && buffer[3] == 0xFF)
+	if (length >= 4 && buffer[0] == 0x00 && buffer[1] == 0x00 && buffer[2] == 0xFE && buffer[3] == 0xFF)
 	{
 		encoding = NSUTF32BigEndianStringEncoding;
 		*skipBytes = 4;
 	}
-	else if (buffer[0] == 0xFF && buffer[1] == 0xFE && buffer[2] == 0x00 && buffer[3] == 0x00)
+	else if (length >= 4 && buffer[0] == 0xFF && buffer[1] == 0xFE && buffer[2] == 0x00 && buffer[3] == 0x00)
 	{
 		encoding = NSUTF32LittleEndianStringEncoding;
 		*skipBytes = 4;
 	}
-	else if (buffer[0] == 0xFE && buffer[1] == 0xFF)
+	else if (length >= 2 && buffer[0] == 0xFE && buffer[1] == 0xFF)
 	{
 		encoding = NSUTF16BigEndianStringEncoding;
 		*skipBytes = 2;
 	}
-	else if (buffer[0] == 0xFF && buffer[1] == 0xFE)
+	else if (length >= 2 && buffer[0] == 0xFF && buffer[1] == 0xFE)
 	{
 		encoding = NSUTF16LittleEndianStringEncoding;
 		*skipBytes = 2;
@@ -162,18 +327,37 @@ static NSStringEncoding getEncoding(NSData* data, unsigned long* skipBytes)
 			encoding = NSUTF16LittleEndianStringEncoding;
 	}
 	
+	if (encoding == NSUTF32BigEndianStringEncoding || encoding == NSUTF32LittleEndianStringEncoding)
+	{
+		scanWide(buffer + *skipBytes, len - *skipBytes, 4, encoding == NSUTF32BigEndianStringEncoding, scan);
+	}
+	else if (encoding == NSUTF16BigEndianStringEncoding || encoding == NSUTF16LittleEndianStringEncoding)
+	{
+		scanWide(buffer + *skipBytes, len - *skipBytes, 2, encoding == NSUTF16BigEndianStringEncoding, scan);
+	}
+	
 	// See if it could be utf-8.
-	if (encoding == 0)
+	else if (all_chars(buffer, isValidUTF8, length))
 	{
-		if (all_chars(buffer, isValidUTF8, length))
+		scanBytes(buffer, len, scan);
+		if (scan->validUTF8)
 			encoding = NSUTF8StringEncoding;
+		
+		// The first few bytes of most legacy documents will look like utf8 so if
+		// the file isn't really utf8 we need to fall back onto a legacy encoding.
+		// Windows-1252 is a lot more common nowadays but it doesn't map every byte
+		// so for those we use Mac OS Roman.
+		else if (!scan->hasCP1252Holes)
+			encoding = NSWindowsCP1252StringEncoding;
+		else
+			encoding = NSMacOSRomanStringEncoding;
 	}
 	
 	// Fall back on Mac OS Roman.
-	if (encoding == 0)
+	else if (all_chars(buffer, isValidMacRoman, length))
 	{
-		if (all_chars(buffer, isValidMacRoman, length))
-			encoding = NSMacOSRomanStringEncoding;
+		scanBytes(buffer, len, scan);
+		encoding = NSMacOSRomanStringEncoding;
 	}
 	
 	return encoding;
@@ -190,38 +374,30 @@ static NSStringEncoding getEncoding(NSData* data, unsigned long* skipBytes)
 	{
 		if ([data length] > 0)
 		{
+			const unsigned char* bytes = data.bytes;
 			unsigned long skipBytes = 0;
-			NSStringEncoding encoding = getEncoding(data, &skipBytes);
+			struct Scan scan = {0};
+			NSStringEncoding encoding = getEncoding(bytes, data.length, &skipBytes, &scan);
 			if (encoding)
 			{
-				if (skipBytes > 0)
-					data = [data subdataWithRange:NSMakeRange(skipBytes, [data length] - skipBytes)];
-				NSMutableString* str = [[NSMutableString alloc] initWithData:data encoding:encoding];
-
-				if (str == nil && encoding == NSUTF8StringEncoding)
-				{
-					// For some awful reason NSUTF8StringEncoding won't decode Windows line
-					// endian files even though they are valid UTF-8. TODO: this will break
-					// if the file really is utf-8 though it's a coin flip as to which
-					// encoding the file is really in without a BOM.
-					encoding = NSWindowsCP1252StringEncoding;
-					str = [[NSMutableString alloc] initWithData:data encoding:encoding];
-				}
+				NSMutableString* str = [[NSMutableString alloc] initWithBytes:bytes + skipBytes length:data.length - skipBytes encoding:encoding];
 				
-				// The first few bytes of most legacy documents will look like utf8 so
-				// if we couldn't decode it using utf8 we need to fall back onto Mac
-				// OS Roman. TODO: this is for pre-OS X docs, do we really want to do
-				// this nowadays?
-				if (str == nil && encoding == NSUTF8StringEncoding)
+				// The scan should have ensured that this can't happen but, if it does,
+				// Mac OS Roman maps every byte.
+				if (str == nil && (encoding == NSUTF8StringEncoding || encoding == NSWindowsCP1252StringEncoding))
 				{
+					LOG("Error", "Failed to decode using %s", STR([NSString localizedNameOfStringEncoding:encoding]));
 					encoding = NSMacOSRomanStringEncoding;
-					str = [[NSMutableString alloc] initWithData:data encoding:encoding];
+					str = [[NSMutableString alloc] initWithBytes:bytes length:data.length encoding:encoding];
 				}
 				
 				if (str != nil)
 				{
 					_text = str;
 					_encoding = encoding;
+					_unixEndings = scan.lf - scan.crlf;
+					_macEndings = scan.cr - scan.crlf;
+					_windowsEndings = scan.crlf;
 				}
 			}
 			if (self.text == nil)
@@ -15,6 +15,7 @@
 #import "Plugins.h"
 #import "TextController.h"
 #import "TranscriptController.h"
+#import "TrigramIndex.h"
 #import "UpdateConfig.h"
 #import "Utils.h"
 
@@ -26,6 +27,7 @@ static DirectoryController* _lastBuilt;
 	MimsyPath* _thePath;
 	FolderItem* _root;
 	DirectoryWatcher* _watcher;
+	TrigramIndex* _index;
 	NSDictionary* _dirAttrs;
 	NSDictionary* _fileAttrs;
 	NSDictionary* _sizeAttrs;
@@ -217,6 +219,8 @@ static DirectoryController* _lastBuilt;
 		_lastBuilt = nil;
 	
 	_watcher = nil;
+	[_index close];
+	_index = nil;
 	[_controllers removeObject:self];
 	self->_closing = true;
 }
@@ -844,6 +848,9 @@ static DirectoryController* _lastBuilt;
 	_watcher = [[DirectoryWatcher alloc] initWithPath:path latency:3.0 block:
 				^(MimsyPath* path, FSEventStreamEventFlags flags) {[self _dirChanged:path flags:flags];}];
 	
+	[_index close];
+	_index = [_layeredSettings boolValue:@"FindAllIndex" missing:true] ? [TrigramIndex open:path] : nil;
+	
 	_builderInfo = [Builders builderInfo:path];
     [self _loadTargets];
     
@@ -1240,6 +1247,7 @@ static NSString* flagsToStr(FSEventStreamEventFlags flags)
         return;
     
     LOG("Mimsy", "%s dir changed %s", STR(_thePath), STR(flagsToStr(flags)));
+    [_index dirChanged:path];
 
     // Update which ever items were opened.
 	FileSystemItem* item = [_root find:path];
@@ -1274,7 +1282,10 @@ static NSString* flagsToStr(FSEventStreamEventFlags flags)
 	if (table && item == _root)
 		[table reloadData];
 
+    // If events were dropped we don't know what changed.
+    FSEventStreamEventFlags dropped = kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagKernelDropped | kFSEventStreamEventFlagMustScanSubDirs;
     AppDelegate* app = (AppDelegate*) [NSApp delegate];
+    [app invokeProjectHook:self path:path recursive:(flags & dropped) != 0];
     [app invokeProjectHook:ProjectNotificationChanged project:self];
 }
 
@@ -0,0 +1,21 @@
+#import <Foundation/Foundation.h>
+#import "MimsyPlugins.h"
+
+typedef void (^WalkerError)(NSString* mesg);
+typedef BOOL (^WalkerPredicate)(MimsyPath* parent, NSString* name);
+typedef void (^WalkerCallback)(MimsyPath* dir, NSArray<NSString*>* names);
+
+/// Calls a block with the regular, non-hidden, files in each directory under a
+/// root. Directory entries are read in batches with getattrlistbulk. Symbolic
+/// links are not followed.
+@interface DirectoryWalker : NSObject
+
+/// Blocks until the walk has finished. If threads is one everything happens on
+/// the calling thread in the same order as a depth first search. Otherwise the
+/// directories are read by a pool of threads and all the blocks may be called
+/// concurrently. dirPredicate may be nil, if it returns false the sub-directory
+/// (and everything under it) is skipped. predicate may be nil, if it returns
+/// false the file isn't passed to callback.
++ (void)walk:(MimsyPath*)root recursive:(bool)recursive threads:(NSUInteger)threads error:(WalkerError)error dirPredicate:(WalkerPredicate)dirPredicate predicate:(WalkerPredicate)predicate callback:(WalkerCallback)callback;
+
+@end
@@ -0,0 +1,175 @@
+#import "DirectoryWalker.h"
+
+#include <fcntl.h>
+#include <sys/attr.h>
+#include <sys/vnode.h>
+#include <unistd.h>
+
+// Each call to getattrlistbulk returns as many entries as will fit.
+const size_t BulkBufferSize = 64*1024;
+
+@implementation DirectoryWalker
+{
+	bool _recursive;
+	WalkerError _error;
+	WalkerPredicate _dirPredicate;
+	WalkerPredicate _predicate;
+	WalkerCallback _callback;
+
+	NSCondition* _condition;
+	NSMutableArray<MimsyPath*>* _pending;
+	NSUInteger _numActive;			// directories being read
+}
+
++ (void)walk:(MimsyPath*)root recursive:(bool)recursive threads:(NSUInteger)threads error:(WalkerError)error dirPredicate:(WalkerPredicate)dirPredicate predicate:(WalkerPredicate)predicate callback:(WalkerCallback)callback
+{
+	ASSERT(threads > 0);
+
+	DirectoryWalker* walker = [DirectoryWalker new];
+	walker->_recursive = recursive;
+	walker->_error = error;
+	walker->_dirPredicate = dirPredicate;
+	walker->_predicate = predicate;
+	walker->_callback = callback;
+	walker->_condition = [NSCondition new];
+	walker->_pending = [NSMutableArray arrayWithObject:root];
+
+	// The calling thread is one of the workers.
+	dispatch_group_t group = dispatch_group_create();
+	dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	for (NSUInteger i = 1; i < threads; ++i)
+		dispatch_group_async(group, concurrent, ^{[walker _work];});
+
+	[walker _work];
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+}
+
+- (void)_work	// threaded
+{
+	char* buffer = malloc(BulkBufferSize);
+
+	while (true)
+	{
+		// We're done once there is nothing left to read and nobody is reading a
+		// directory (which might add more).
+		[_condition lock];
+		while (_pending.count == 0 && _numActive > 0)
+			[_condition wait];
+
+		MimsyPath* dir = [_pending lastObject];
+		if (!dir)
+		{
+			[_condition broadcast];
+			[_condition unlock];
+			break;
+		}
+		[_pending removeLastObject];
+		++_numActive;
+		[_condition unlock];
+
+		NSArray* subDirs;
+		@autoreleasepool
+		{
+			subDirs = [self _processDir:dir buffer:buffer];
+		}
+
+		[_condition lock];
+		[_pending addObjectsFromArray:subDirs];
+		--_numActive;
+		[_condition broadcast];
+		[_condition unlock];
+	}
+
+	free(buffer);
+}
+
+// Calls the callback for the files in dir and returns the sub-directories to walk.
+- (NSArray*)_processDir:(MimsyPath*)dir buffer:(char*)buffer	// threaded
+{
+	NSMutableArray<MimsyPath*>* subDirs = [NSMutableArray new];
+	NSMutableArray<NSString*>* fileNames = [NSMutableArray new];
+
+	int fd = open(dir.asString.UTF8String, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+	{
+		NSString* mesg = [[NSString alloc] initWithFormat:@"Failed to open '%@': %s.", dir, strerror(errno)];
+		_error(mesg);
+		return subDirs;
+	}
+
+	struct attrlist attrs = {0};
+	attrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+	attrs.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | ATTR_CMN_ERROR | ATTR_CMN_OBJTYPE;
+
+	while (true)
+	{
+		int count = getattrlistbulk(fd, &attrs, buffer, BulkBufferSize, 0);
+		if (count < 0)
+		{
+			NSString* mesg = [[NSString alloc] initWithFormat:@"Failed to read '%@': %s.", dir, strerror(errno)];
+			_error(mesg);
+			break;
+		}
+		else if (count == 0)
+		{
+			break;
+		}
+
+		// See the getattrlistbulk man page for the layout of the entries.
+		char* entry = buffer;
+		for (int i = 0; i < count; ++i)
+		{
+			char* field = entry;
+			uint32_t length = *(uint32_t*) field;
+			field += sizeof(uint32_t);
+			entry += length;
+
+			attribute_set_t returned = *(attribute_set_t*) field;
+			field += sizeof(attribute_set_t);
+
+			if (returned.commonattr & ATTR_CMN_ERROR)
+			{
+				uint32_t err = *(uint32_t*) field;
+				field += sizeof(uint32_t);
+				if (err)
+					continue;
+			}
+
+			if (!(returned.commonattr & ATTR_CMN_NAME) || !(returned.commonattr & ATTR_CMN_OBJTYPE))
+				continue;
+
+			attrreference_t nameRef = *(attrreference_t*) field;
+			const char* name = field + nameRef.attr_dataoffset;
+			field += sizeof(attrreference_t);
+
+			fsobj_type_t type = *(fsobj_type_t*) field;
+			if (name[0] == '.' || (type != VREG && !(_recursive && type == VDIR)))
+				continue;
+
+			NSString* fileName = [[NSString alloc] initWithBytes:name length:strlen(name) encoding:NSUTF8StringEncoding];
+			if (!fileName)
+				continue;
+
+			if (type == VREG)
+			{
+				if (!_predicate || _predicate(dir, fileName))
+					[fileNames addObject:fileName];
+			}
+			else
+			{
+				if (!_dirPredicate || _dirPredicate(dir, fileName))
+					[subDirs addObject:[dir appendWithComponent:fileName]];
+			}
+		}
+	}
+	(void) close(fd);
+
+	// Batching the files up should be faster because w'll get better locality reading the directory
+	// contents before dealing with files. Probably won't make much difference for local volumes but
+	// remote volumes can be quite slow.
+	_callback(dir, fileNames);
+
+	return subDirs;
+}
+
+@end
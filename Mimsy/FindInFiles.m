@@ -16,6 +16,7 @@
 	FindResultsController* _resultsController;
 	NSUInteger _numFiles;
 	NSUInteger _numMatches;
+	int32_t _numEmptyFiles;
 	
 	NSString* _findText;
 	bool _reversePaths;
@@ -72,17 +73,9 @@
 		   {
 			   LOG("Find:Verbose", "Found %lu open paths", openPaths.count);
 			   if ([self.root.asString compare:@"Open Windows"] == NSOrderedSame)
-			   {
-				   self.numFilesLeft = (int) openPaths.count;
-				   if (openPaths.count > 0)
-					   [self _step3QueuePaths:openPaths];
-				   else
-					   [self _onFinish];
-			   }
+				   [self _step3QueuePaths:openPaths];
 			   else
-			   {
 				   [self _step2FindPaths];
-			   }
 		   });
 	};
 	
@@ -129,6 +122,11 @@
 
 - (bool)_processMatches:(NSArray*)matches forPath:(MimsyPath*)path withContents:(NSMutableString*)contents	// threaded
 {	
+	// With lots of files there's no point in flooding the main thread with title
+	// updates for files without matches.
+	if (matches.count == 0 && OSAtomicIncrement32(&_numEmptyFiles) % 64 != 0)
+		return false;
+	
 	NSAttributedString* pathStr = [self _getPathString:path];
 	NSArray* matchStrs = [matches map:
 		  ^id (NSTextCheckingResult *match)
@@ -172,7 +170,7 @@
 {
 	NSString* title;
 
-	if (self.numFilesLeft == 0)
+	if (self.finished)
 	{
 		if (_numMatches > 0)
 		{
@@ -186,6 +184,10 @@
 			title = [NSString stringWithFormat:@"Find '%@' had no matches", _findText];
 		}
 	}
+	else if (self.numFilesLeft == 0)
+	{
+		title = [NSString stringWithFormat:@"Find '%@' gathering paths", _findText];
+	}
 	else if (self.numFilesLeft == 1)
 	{
 		title = [NSString stringWithFormat:@"Find '%@' with 1 file left", _findText];
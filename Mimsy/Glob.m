@@ -1,7 +1,11 @@
 #import "Glob.h"
-#import <fnmatch.h>
+
+#import "GlobMatcher.h"
 
 @implementation Glob
+{
+	GlobMatcher* _matcher;
+}
 
 - (BOOL)matches:(MimsyPath*)path
 {
@@ -11,33 +15,25 @@
 - (id)initWithGlob:(NSString*)glob
 {
 	_globs = [NSArray arrayWithObject:glob];
+	_matcher = [[GlobMatcher alloc] initWithGlobs:_globs];
 	return self;
 }
 
 - (id)initWithGlobs:(NSArray*)globs
 {
 	_globs = globs;
+	_matcher = [[GlobMatcher alloc] initWithGlobs:_globs];
 	return self;
 }
 
 - (int)matchName:(NSString*)name
 {
-	for (NSString* glob in _globs)
-	{
-		if (fnmatch([glob UTF8String], [name UTF8String], FNM_CASEFOLD) == 0)
-			return 1;
-	}
-	return 0;
+	return [self matchStr:name.UTF8String];
 }
 
 - (int)matchStr:(const char*)name
 {
-	for (NSString* glob in _globs)
-	{
-		if (fnmatch([glob UTF8String], name, FNM_CASEFOLD) == 0)
-			return 1;
-	}
-	return 0;
+	return [_matcher matchBytes:name length:strlen(name)] ? 1 : 0;
 }
 
 - (id)copyWithZone:(NSZone*)zone
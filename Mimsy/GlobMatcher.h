@@ -0,0 +1,16 @@
+#import <Foundation/Foundation.h>
+
+/// Compiles a list of globs into a single matcher so that matching a name takes
+/// time proportional to the length of the name instead of the number of globs.
+/// Globs of the form "*.ext" are handled with a hash set of extensions and the
+/// rest are combined into a DFA. Matching follows fnmatch with FNM_CASEFOLD (and
+/// only ASCII letters are case folded). Matchers are immutable so they may be
+/// used from any thread.
+@interface GlobMatcher : NSObject
+
+- (id)initWithGlobs:(NSArray*)globs;
+
+/// Returns true if at least one of the globs matches the UTF-8 bytes.
+- (bool)matchBytes:(const char*)bytes length:(NSUInteger)length;	// threaded
+
+@end
@@ -0,0 +1,508 @@
+#import "GlobMatcher.h"
+
+#import "Logger.h"
+#import "Utils.h"
+
+// The DFA is built when the matcher is created so this bounds the work (and
+// memory) that pathological globs can cause. If it's exceeded we fall back to
+// simulating the NFA which is still linear in the length of the name.
+const NSUInteger MaxDFAStates = 1024;
+
+enum TokenKind {SetToken, StarToken, AcceptToken};
+
+struct ByteSet
+{
+	uint64_t bits[4];
+};
+
+// Each glob is compiled into a sequence of tokens ending with an AcceptToken.
+// NFA states are indexes into the combined token array: being in state i means
+// that the tokens before i have matched.
+struct Token
+{
+	enum TokenKind kind;
+	struct ByteSet set;		// only used for SetToken
+};
+
+struct ExtSlot
+{
+	uint64_t hash;
+	uint32_t offset;		// into _extBytes
+	uint32_t length;		// zero for an empty slot
+};
+
+static uint8_t foldByte(uint8_t b)
+{
+	return b >= 'A' && b <= 'Z' ? b + ('a' - 'A') : b;
+}
+
+static bool inSet(const struct ByteSet* set, uint8_t b)
+{
+	return (set->bits[b >> 6] >> (b & 63)) & 1;
+}
+
+static void addToSet(struct ByteSet* set, uint8_t b)
+{
+	set->bits[b >> 6] |= 1ULL << (b & 63);
+}
+
+static bool testBit(const uint64_t* bits, NSUInteger i)
+{
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static void setBit(uint64_t* bits, NSUInteger i)
+{
+	bits[i >> 6] |= 1ULL << (i & 63);
+}
+
+static void addToken(NSMutableData* tokens, enum TokenKind kind, const struct ByteSet* set)
+{
+	struct Token token = {.kind = kind};
+	if (set)
+		token.set = *set;
+	[tokens appendBytes:&token length:sizeof(token)];
+}
+
+static void addLiteral(NSMutableData* tokens, uint8_t ch)
+{
+	struct ByteSet set = {{0}};
+	addToSet(&set, ch);
+	addToSet(&set, foldByte(ch));
+	if (ch >= 'a' && ch <= 'z')
+		addToSet(&set, ch - ('a' - 'A'));
+	addToken(tokens, SetToken, &set);
+}
+
+// Start is the index after the '['. Returns the index after the closing ']' or
+// 0 if the expression isn't well formed (in which case fnmatch treats the '['
+// as a literal).
+static NSUInteger parseBracket(const uint8_t* glob, NSUInteger length, NSUInteger start, struct ByteSet* result)
+{
+	NSUInteger i = start;
+	bool negate = i < length && (glob[i] == '!' || glob[i] == '^');
+	if (negate)
+		++i;
+
+	struct ByteSet set = {{0}};
+	bool first = true;
+	while (true)
+	{
+		if (i >= length)
+			return 0;
+
+		uint8_t lower = glob[i++];
+		if (lower == ']' && !first)
+			break;
+		first = false;
+
+		if (lower == '\\')
+		{
+			if (i >= length)
+				return 0;
+			lower = glob[i++];
+		}
+
+		uint8_t upper = lower;
+		if (i + 1 < length && glob[i] == '-' && glob[i+1] != ']')
+		{
+			upper = glob[i+1];
+			i += 2;
+			if (upper == '\\')
+			{
+				if (i >= length)
+					return 0;
+				upper = glob[i++];
+			}
+		}
+
+		for (NSUInteger b = 0; b < 256; ++b)
+		{
+			uint8_t test = foldByte((uint8_t) b);
+			if (foldByte(lower) <= test && test <= foldByte(upper))
+				addToSet(&set, (uint8_t) b);
+		}
+	}
+
+	if (negate)
+	{
+		for (NSUInteger j = 0; j < 4; ++j)
+			set.bits[j] = ~set.bits[j];
+	}
+
+	*result = set;
+	return i;
+}
+
+static void parseGlob(const uint8_t* glob, NSUInteger length, NSMutableData* tokens)
+{
+	NSUInteger i = 0;
+	while (i < length)
+	{
+		uint8_t ch = glob[i++];
+		if (ch == '*')
+		{
+			addToken(tokens, StarToken, NULL);
+		}
+		else if (ch == '?')
+		{
+			struct ByteSet any;
+			memset(&any, 0xFF, sizeof(any));
+			addToken(tokens, SetToken, &any);
+		}
+		else if (ch == '[')
+		{
+			struct ByteSet set;
+			NSUInteger next = parseBracket(glob, length, i, &set);
+			if (next > 0)
+			{
+				addToken(tokens, SetToken, &set);
+				i = next;
+			}
+			else
+			{
+				addLiteral(tokens, ch);
+			}
+		}
+		else if (ch == '\\' && i < length)
+		{
+			addLiteral(tokens, glob[i++]);
+		}
+		else
+		{
+			addLiteral(tokens, ch);
+		}
+	}
+	addToken(tokens, AcceptToken, NULL);
+}
+
+// Returns the extension if glob is of the form "*.ext" where ext is a plain
+// name. Note that this means that a name matches iff the bytes after its last
+// dot are ext.
+static NSData* getExtension(const uint8_t* glob, NSUInteger length)
+{
+	if (length < 3 || glob[0] != '*' || glob[1] != '.')
+		return nil;
+
+	NSMutableData* ext = [NSMutableData dataWithLength:length - 2];
+	uint8_t* bytes = ext.mutableBytes;
+	for (NSUInteger i = 2; i < length; ++i)
+	{
+		if (strchr("*?[\\.", glob[i]))
+			return nil;
+		bytes[i - 2] = foldByte(glob[i]);
+	}
+	return ext;
+}
+
+@implementation GlobMatcher
+{
+	NSData* _extSlots;			// open addressed hash set of ExtSlot
+	NSData* _extBytes;
+	NSUInteger _extMask;
+	NSUInteger _maxExtLength;
+
+	NSData* _tokens;
+	NSUInteger _numTokens;		// the number of NFA states
+	NSUInteger _numWords;		// the number of words in a set of NFA states
+	NSData* _startStates;
+
+	uint8_t _classes[256];		// bytes in the same class always take the same transitions
+	NSUInteger _numClasses;
+	NSData* _transitions;		// int32_t [state*_numClasses + class] or nil if there is no DFA
+	NSData* _accepting;			// bool [state]
+	int32_t _deadState;			// -1 if there isn't a dead state
+}
+
+- (id)initWithGlobs:(NSArray*)globs
+{
+	self = [super init];
+	if (self)
+	{
+		NSMutableArray* exts = [NSMutableArray new];
+		NSMutableData* tokens = [NSMutableData new];
+
+		for (NSString* glob in globs)
+		{
+			const uint8_t* bytes = (const uint8_t*) glob.UTF8String;
+			NSUInteger length = strlen((const char*) bytes);
+
+			NSData* ext = getExtension(bytes, length);
+			if (ext)
+				[exts addObject:ext];
+			else
+				parseGlob(bytes, length, tokens);
+		}
+
+		[self _buildExtensions:exts];
+
+		_tokens = tokens;
+		_numTokens = tokens.length/sizeof(struct Token);
+		_numWords = (_numTokens + 63)/64;
+		if (_numTokens > 0)
+			[self _buildDFA];
+	}
+	return self;
+}
+
+- (void)_buildExtensions:(NSArray*)exts
+{
+	NSUInteger capacity = 8;
+	while (capacity < 2*exts.count)
+		capacity *= 2;
+	_extMask = capacity - 1;
+
+	NSMutableData* slots = [NSMutableData dataWithLength:capacity*sizeof(struct ExtSlot)];
+	NSMutableData* bytes = [NSMutableData new];
+	struct ExtSlot* table = slots.mutableBytes;
+
+	for (NSData* ext in exts)
+	{
+		uint64_t hash = hashBytes(FNVOffsetBasis, ext.bytes, ext.length);
+		NSUInteger i = hash & _extMask;
+		while (table[i].length > 0)
+			i = (i + 1) & _extMask;
+
+		table[i].hash = hash;
+		table[i].offset = (uint32_t) bytes.length;
+		table[i].length = (uint32_t) ext.length;
+		[bytes appendData:ext];
+
+		_maxExtLength = MAX(_maxExtLength, ext.length);
+	}
+
+	_extSlots = slots;
+	_extBytes = bytes;
+}
+
+#pragma mark - NFA
+
+// Stars can match nothing so being in front of a star means we are also after it.
+// Stars only ever move forward so a single pass is enough.
+- (void)_closure:(uint64_t*)states
+{
+	const struct Token* tokens = _tokens.bytes;
+	for (NSUInteger i = 0; i < _numTokens; ++i)
+	{
+		if (tokens[i].kind == StarToken && testBit(states, i))
+			setBit(states, i + 1);
+	}
+}
+
+- (void)_step:(const uint64_t*)states byte:(uint8_t)byte into:(uint64_t*)next
+{
+	const struct Token* tokens = _tokens.bytes;
+	memset(next, 0, _numWords*sizeof(uint64_t));
+
+	for (NSUInteger w = 0; w < _numWords; ++w)
+	{
+		uint64_t bits = states[w];
+		while (bits)
+		{
+			NSUInteger i = 64*w + (NSUInteger) __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			if (tokens[i].kind == StarToken)
+				setBit(next, i);
+			else if (tokens[i].kind == SetToken && inSet(&tokens[i].set, byte))
+				setBit(next, i + 1);
+		}
+	}
+
+	[self _closure:next];
+}
+
+- (bool)_isAccepting:(const uint64_t*)states
+{
+	const struct Token* tokens = _tokens.bytes;
+	for (NSUInteger w = 0; w < _numWords; ++w)
+	{
+		uint64_t bits = states[w];
+		while (bits)
+		{
+			NSUInteger i = 64*w + (NSUInteger) __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			if (tokens[i].kind == AcceptToken)
+				return true;
+		}
+	}
+	return false;
+}
+
+- (bool)_simulate:(const uint8_t*)bytes length:(NSUInteger)length	// threaded
+{
+	uint64_t buffer1[_numWords], buffer2[_numWords];
+	uint64_t* states = buffer1;
+	uint64_t* next = buffer2;
+	memcpy(states, _startStates.bytes, _numWords*sizeof(uint64_t));
+
+	for (NSUInteger i = 0; i < length; ++i)
+	{
+		[self _step:states byte:bytes[i] into:next];
+
+		uint64_t* temp = states;
+		states = next;
+		next = temp;
+	}
+
+	return [self _isAccepting:states];
+}
+
+#pragma mark - DFA
+
+// Bytes which are in exactly the same token sets are interchangeable so the DFA
+// only needs a column for each class of bytes.
+- (void)_buildClasses
+{
+	const struct Token* tokens = _tokens.bytes;
+	memset(_classes, 0, sizeof(_classes));
+	_numClasses = 1;
+
+	for (NSUInteger i = 0; i < _numTokens; ++i)
+	{
+		if (tokens[i].kind != SetToken)
+			continue;
+
+		int16_t remap[256][2];
+		memset(remap, 0xFF, sizeof(remap));
+
+		NSUInteger count = 0;
+		for (NSUInteger b = 0; b < 256; ++b)
+		{
+			int in = inSet(&tokens[i].set, (uint8_t) b);
+			int16_t* entry = &remap[_classes[b]][in];
+			if (*entry < 0)
+				*entry = (int16_t) count++;
+			_classes[b] = (uint8_t) *entry;
+		}
+		_numClasses = count;
+	}
+}
+
+- (void)_buildDFA
+{
+	const struct Token* tokens = _tokens.bytes;
+	NSUInteger setBytes = _numWords*sizeof(uint64_t);
+
+	NSMutableData* start = [NSMutableData dataWithLength:setBytes];
+	bool atStart = true;
+	for (NSUInteger i = 0; i < _numTokens; ++i)
+	{
+		if (atStart)
+			setBit(start.mutableBytes, i);
+		atStart = tokens[i].kind == AcceptToken;
+	}
+	[self _closure:start.mutableBytes];
+	_startStates = start;
+
+	[self _buildClasses];
+	uint8_t representatives[256];
+	for (NSUInteger b = 0; b < 256; ++b)
+		representatives[_classes[b]] = (uint8_t) b;
+
+	// Subset construction: DFA state i is the set of NFA states sets[i].
+	NSMutableArray* sets = [NSMutableArray arrayWithObject:start];
+	NSMutableDictionary* indexes = [NSMutableDictionary dictionaryWithObject:@0 forKey:start];
+	NSMutableData* transitions = [NSMutableData new];
+	NSMutableData* accepting = [NSMutableData new];
+	_deadState = -1;
+
+	for (NSUInteger s = 0; s < sets.count; ++s)
+	{
+		NSData* states = sets[s];
+		bool accepts = [self _isAccepting:states.bytes];
+		[accepting appendBytes:&accepts length:sizeof(accepts)];
+
+		if (_deadState < 0 && [self _isEmpty:states.bytes])
+			_deadState = (int32_t) s;
+
+		for (NSUInteger c = 0; c < _numClasses; ++c)
+		{
+			NSMutableData* next = [NSMutableData dataWithLength:setBytes];
+			[self _step:states.bytes byte:representatives[c] into:next.mutableBytes];
+
+			NSNumber* index = indexes[next];
+			if (!index)
+			{
+				if (sets.count >= MaxDFAStates)
+				{
+					LOG("Warning", "Glob DFA has more than %lu states, falling back to an NFA", MaxDFAStates);
+					return;
+				}
+
+				index = @(sets.count);
+				indexes[next] = index;
+				[sets addObject:next];
+			}
+
+			int32_t target = index.intValue;
+			[transitions appendBytes:&target length:sizeof(target)];
+		}
+	}
+
+	_transitions = transitions;
+	_accepting = accepting;
+}
+
+- (bool)_isEmpty:(const uint64_t*)states
+{
+	for (NSUInteger w = 0; w < _numWords; ++w)
+	{
+		if (states[w])
+			return false;
+	}
+	return true;
+}
+
+#pragma mark - Matching
+
+- (bool)_matchExtension:(const uint8_t*)bytes length:(NSUInteger)length	// threaded
+{
+	if (_maxExtLength == 0)
+		return false;
+
+	NSUInteger i = length;
+	while (i > 0 && bytes[i - 1] != '.')
+		--i;
+	if (i == 0 || length - i > _maxExtLength)
+		return false;
+
+	NSUInteger extLength = length - i;
+	uint8_t ext[_maxExtLength];
+	for (NSUInteger j = 0; j < extLength; ++j)
+		ext[j] = foldByte(bytes[i + j]);
+
+	uint64_t hash = hashBytes(FNVOffsetBasis, ext, extLength);
+	const struct ExtSlot* table = _extSlots.bytes;
+	const uint8_t* extBytes = _extBytes.bytes;
+	for (NSUInteger k = hash & _extMask; table[k].length > 0; k = (k + 1) & _extMask)
+	{
+		if (table[k].hash == hash && table[k].length == extLength && memcmp(extBytes + table[k].offset, ext, extLength) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+- (bool)matchBytes:(const char*)bytes length:(NSUInteger)length	// threaded
+{
+	const uint8_t* str = (const uint8_t*) bytes;
+	if ([self _matchExtension:str length:length])
+		return true;
+
+	if (_numTokens == 0)
+		return false;
+
+	if (!_transitions)
+		return [self _simulate:str length:length];
+
+	const int32_t* transitions = _transitions.bytes;
+	int32_t state = 0;
+	for (NSUInteger i = 0; i < length && state != _deadState; ++i)
+		state = transitions[(NSUInteger) state*_numClasses + _classes[str[i]]];
+
+	return ((const bool*) _accepting.bytes)[state];
+}
+
+@end
@@ -0,0 +1,32 @@
+#import <Cocoa/Cocoa.h>
+
+@class GlyphScanner, StylerToken, TextController;
+
+/// Ranges of text which are drawn with different glyphs or colors, e.g. leading
+/// tabs, long lines, and the character mappings registered by plugins. There is
+/// a layer of ranges for each mapping and the ranges within a layer are sorted and
+/// don't overlap. These are not changed after they are computed so they may be
+/// created on a thread and handed off to the main thread.
+@interface GlyphRuns : NSObject
+
+/// Adds the attributes for the ranges which intersect range (ranges are added in
+/// their entirety so that mappings which draw glyphs once per range work). Layers
+/// are applied in order so later layers take precedence.
+- (void)applyTo:(NSTextStorage*)storage range:(NSRange)range;
+
+@end
+
+/// Snapshot of the glyph mappings enabled for a document. This is created on the
+/// main thread and then used by the styler task to compute GlyphRuns so that the
+/// main thread only has to apply the results.
+@interface GlyphScanner : NSObject
+
+- (id)initWithController:(TextController*)controller;
+
+/// Returns nil if there is nothing to scan for or the token was cancelled. If
+/// previous was computed by an equivalent scanner then edited and delta describe
+/// the changes made to the text since then and only the lines around the edit are
+/// re-scanned.
+- (GlyphRuns*)scan:(NSString*)text previous:(GlyphRuns*)previous edited:(NSRange)edited delta:(NSInteger)delta token:(StylerToken*)token;	// threaded
+
+@end
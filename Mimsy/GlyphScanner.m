@@ -0,0 +1,386 @@
+#import "GlyphScanner.h"
+
+#import "AsyncStyler.h"
+#import "GlyphsAttribute.h"
+#import "RangeVector.h"
+#import "TextController.h"
+#import "TextStyles.h"
+
+// The built-in layers follow the layers for the character mappings. These are
+// very awkward to handle via a regex so instead of using mappings we simply
+// hard-code them.
+enum BuiltinLayer {LeadingTabsLayer, NonLeadingTabsLayer, LeadingSpacesLayer, LongLinesLayer, NumBuiltinLayers};
+
+// Number of characters we copy out of the string at a time. Chunks are extended to
+// the end of a line so that the line scanning code doesn't have to deal with lines
+// which cross chunks.
+const NSUInteger GlyphChunkSize = 16*1024;
+
+@interface GlyphScanner ()
+@property (readonly) NSArray* attributes;
+@end
+
+@implementation GlyphRuns
+{
+@public
+	GlyphScanner* _scanner;
+	struct RangeVector* _layers;
+	NSUInteger _numLayers;
+}
+
+- (id)initWithScanner:(GlyphScanner*)scanner layers:(NSUInteger)count
+{
+	self = [super init];
+	if (self)
+	{
+		_scanner = scanner;
+		_numLayers = count;
+		_layers = malloc(count*sizeof(struct RangeVector));
+		for (NSUInteger i = 0; i < count; ++i)
+			_layers[i] = newRangeVector();
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	for (NSUInteger i = 0; i < _numLayers; ++i)
+		freeRangeVector(_layers + i);
+	free(_layers);
+}
+
+// Returns the index of the first range which ends after loc.
+static NSUInteger searchRanges(const struct RangeVector* ranges, NSUInteger loc)
+{
+	NSUInteger lo = 0;
+	NSUInteger hi = ranges->count;
+	while (lo < hi)
+	{
+		NSUInteger mid = (lo + hi)/2;
+		if (NSMaxRange(ranges->data[mid]) <= loc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+- (void)applyTo:(NSTextStorage*)storage range:(NSRange)range
+{
+	NSUInteger length = storage.length;
+	for (NSUInteger layer = 0; layer < _numLayers; ++layer)
+	{
+		const struct RangeVector* ranges = _layers + layer;
+		NSDictionary* attrs = _scanner.attributes[layer];
+		for (NSUInteger i = searchRanges(ranges, range.location); i < ranges->count && ranges->data[i].location < NSMaxRange(range); ++i)
+		{
+			NSRange r = ranges->data[i];
+			if (NSMaxRange(r) <= length)	// can happen if the text is edited
+				[storage addAttributes:attrs range:r];
+		}
+	}
+}
+
+@end
+
+@implementation GlyphScanner
+{
+	NSArray* _regexen;
+	bool _enabled[NumBuiltinLayers];
+	NSUInteger _tabWidth;
+	NSUInteger _maxWidth;
+	bool _useTabWidth;
+}
+
+- (id)initWithController:(TextController*)controller
+{
+	self = [super init];
+	if (self)
+	{
+		TextStyles* styles = controller.styles;
+		NSMutableArray* regexen = [NSMutableArray new];
+		NSMutableArray* attributes = [NSMutableArray new];
+		for (CharacterMapping* mapping in controller.charMappings)
+		{
+			NSMutableDictionary* attrs = [[styles attributesForElement:mapping.style] mutableCopy];
+			attrs[GlyphsAttributeName] = mapping.glyphs;
+
+			[regexen addObject:mapping.regex];
+			[attributes addObject:attrs];
+		}
+
+		NSDictionary* warning = [styles attributesForElement:@"warning"];
+		GlyphsAttribute* arrow = [styles glyphsForElement:@"warning" chars:@"\u279C" repeat:true];	// HEAVY ROUND-TIPPED RIGHTWARDS ARROW
+		GlyphsAttribute* bullet = [styles glyphsForElement:@"warning" chars:@"\u2022" repeat:true];	// BULLET
+
+		NSMutableDictionary* tabs = [warning mutableCopy];
+		tabs[GlyphsAttributeName] = arrow;
+		NSMutableDictionary* spaces = [warning mutableCopy];
+		spaces[GlyphsAttributeName] = bullet;
+
+		[attributes addObject:tabs];
+		[attributes addObject:tabs];
+		[attributes addObject:spaces];
+		[attributes addObject:@{NSForegroundColorAttributeName:[NSColor redColor]}];
+
+		_regexen = regexen;
+		_attributes = attributes;
+
+		_enabled[LeadingTabsLayer] = controller.showingLeadingTabs;
+		_enabled[NonLeadingTabsLayer] = controller.showingNonLeadingTabs;
+		_enabled[LeadingSpacesLayer] = controller.showingLeadingSpaces;
+		_enabled[LongLinesLayer] = controller.showingLongLines;
+
+		_tabWidth = (NSUInteger) [controller.layeredSettings intValue:@"TabWidth" missing:4];
+		_maxWidth = (NSUInteger) [controller.layeredSettings intValue:@"MaxLineWidth" missing:80];
+		_useTabWidth = [controller.layeredSettings boolValue:@"LongLineIncludesTabWidth" missing:false];
+	}
+	return self;
+}
+
+- (bool)_empty
+{
+	bool empty = _regexen.count == 0;
+	for (NSUInteger i = 0; i < NumBuiltinLayers && empty; ++i)
+		empty = !_enabled[i];
+	return empty;
+}
+
+- (bool)_sameAs:(GlyphScanner*)rhs
+{
+	if (rhs == self)
+		return true;
+
+	return [_regexen isEqualToArray:rhs->_regexen] && [_attributes isEqualToArray:rhs->_attributes] &&
+		memcmp(_enabled, rhs->_enabled, sizeof(_enabled)) == 0 &&
+		_tabWidth == rhs->_tabWidth && _maxWidth == rhs->_maxWidth && _useTabWidth == rhs->_useTabWidth;
+}
+
+- (GlyphRuns*)scan:(NSString*)text previous:(GlyphRuns*)previous edited:(NSRange)edited delta:(NSInteger)delta token:(StylerToken*)token
+{
+	if ([self _empty])
+		return nil;
+
+	NSUInteger numLayers = _regexen.count + NumBuiltinLayers;
+	GlyphRuns* runs = [[GlyphRuns alloc] initWithScanner:self layers:numLayers];
+	if (!previous || ![self _sameAs:previous->_scanner])
+	{
+		[self _scan:text range:NSMakeRange(0, text.length) runs:runs token:token];
+	}
+	else
+	{
+		// The line after the edit is included because it may have become the start of
+		// a line (which matters for things like leading tabs). Ranges which overlap the
+		// edited lines may extend onto other lines (e.g. for a regex which matches new
+		// lines) so we grow the span we re-scan until it covers all of those. Note that,
+		// like the main thread used to, we don't find new matches which would extend
+		// past the span.
+		NSRange span = [text lineRangeForRange:NSMakeRange(edited.location, MIN(edited.length + 1, text.length - edited.location))];
+		bool grew = true;
+		while (grew)
+		{
+			grew = false;
+			NSUInteger oldEnd = (NSUInteger) ((NSInteger) NSMaxRange(span) - delta);
+			for (NSUInteger layer = 0; layer < numLayers; ++layer)
+			{
+				const struct RangeVector* ranges = previous->_layers + layer;
+				for (NSUInteger i = searchRanges(ranges, span.location); i < ranges->count && ranges->data[i].location < oldEnd; ++i)
+				{
+					NSRange r = ranges->data[i];
+					NSUInteger start = MIN(r.location, span.location);
+					NSUInteger end = (NSUInteger) MAX((NSInteger) NSMaxRange(r) + delta, (NSInteger) NSMaxRange(span));
+					if (start < span.location || end > NSMaxRange(span))
+					{
+						span = [text lineRangeForRange:NSMakeRange(start, MIN(end, text.length) - start)];
+						grew = true;
+						break;
+					}
+				}
+			}
+		}
+
+		// Ranges before the span are unchanged and ranges after it have only moved.
+		NSUInteger oldEnd = (NSUInteger) ((NSInteger) NSMaxRange(span) - delta);
+		for (NSUInteger layer = 0; layer < numLayers; ++layer)
+		{
+			const struct RangeVector* ranges = previous->_layers + layer;
+			NSUInteger count = searchRanges(ranges, span.location);
+			reserveRangeVector(runs->_layers + layer, count + 16);
+			for (NSUInteger i = 0; i < count; ++i)
+				pushRangeVector(runs->_layers + layer, ranges->data[i]);
+		}
+
+		[self _scan:text range:span runs:runs token:token];
+
+		for (NSUInteger layer = 0; layer < numLayers; ++layer)
+		{
+			const struct RangeVector* ranges = previous->_layers + layer;
+			for (NSUInteger i = searchRanges(ranges, oldEnd); i < ranges->count; ++i)
+			{
+				NSRange r = ranges->data[i];
+				if (r.location >= oldEnd)
+					pushRangeVector(runs->_layers + layer, NSMakeRange((NSUInteger) ((NSInteger) r.location + delta), r.length));
+			}
+		}
+	}
+
+	return token.cancelled ? nil : runs;
+}
+
+// Range should start at the beginning of a line.
+- (void)_scan:(NSString*)text range:(NSRange)range runs:(GlyphRuns*)runs token:(StylerToken*)token
+{
+	for (NSUInteger i = 0; i < _regexen.count && !token.cancelled; ++i)
+	{
+		NSRegularExpression* regex = _regexen[i];
+		struct RangeVector* ranges = runs->_layers + i;
+		[regex enumerateMatchesInString:text options:NSMatchingWithTransparentBounds range:range usingBlock:
+			^(NSTextCheckingResult* match, NSMatchingFlags flags, BOOL* stop)
+			{
+				UNUSED(flags, stop);
+
+				NSRange r = [match rangeAtIndex:regex.numberOfCaptureGroups];
+				if (r.location != NSNotFound && r.length > 0)
+					pushRangeVector(ranges, r);
+			}
+		];
+	}
+
+	bool builtins = false;
+	for (NSUInteger i = 0; i < NumBuiltinLayers; ++i)
+		builtins = builtins || _enabled[i];
+
+	if (builtins)
+	{
+		NSUInteger capacity = GlyphChunkSize;
+		unichar* buffer = malloc(capacity*sizeof(unichar));
+
+		NSUInteger offset = range.location;
+		NSUInteger end = NSMaxRange(range);
+		while (offset < end && !token.cancelled)
+		{
+			NSUInteger chunkEnd = MIN(offset + GlyphChunkSize, end);
+			if (chunkEnd < end)
+			{
+				NSRange newline = [text rangeOfString:@"\n" options:NSLiteralSearch range:NSMakeRange(chunkEnd - 1, end - chunkEnd + 1)];
+				chunkEnd = newline.location != NSNotFound ? NSMaxRange(newline) : end;
+			}
+
+			if (chunkEnd - offset > capacity)
+			{
+				capacity = chunkEnd - offset;
+				buffer = realloc(buffer, capacity*sizeof(unichar));
+			}
+			[text getCharacters:buffer range:NSMakeRange(offset, chunkEnd - offset)];
+
+			NSUInteger lineStart = 0;
+			while (lineStart < chunkEnd - offset)
+			{
+				NSUInteger lineEnd = lineStart;
+				while (lineEnd < chunkEnd - offset && buffer[lineEnd] != '\n')	// note that Mimsy always uses Unix line endings internally
+					++lineEnd;
+
+				[self _scanLine:buffer start:lineStart end:lineEnd base:offset runs:runs];
+				lineStart = lineEnd + 1;
+			}
+			offset = chunkEnd;
+		}
+
+		free(buffer);
+	}
+}
+
+// Line is [start, end) within buffer and doesn't include the new line. Base is
+// the offset of buffer within the text.
+- (void)_scanLine:(const unichar*)buffer start:(NSUInteger)start end:(NSUInteger)end base:(NSUInteger)base runs:(GlyphRuns*)runs
+{
+	struct RangeVector* layers = runs->_layers + _regexen.count;
+
+	if (_enabled[LeadingTabsLayer])
+	{
+		NSUInteger i = start;
+		while (i < end && (buffer[i] == '\t' || buffer[i] == ' '))
+		{
+			if (buffer[i] == '\t')
+			{
+				NSUInteger j = i;
+				while (j < end && buffer[j] == '\t')
+					++j;
+				pushRangeVector(layers + LeadingTabsLayer, NSMakeRange(base + i, j - i));
+				i = j;
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
+	if (_enabled[NonLeadingTabsLayer])
+	{
+		// Note that tabs following leading spaces are considered to be non-leading.
+		NSUInteger i = start;
+		while (i < end)
+		{
+			if (buffer[i] == '\t')
+			{
+				NSUInteger j = i;
+				while (j < end && buffer[j] == '\t')
+					++j;
+				if (i > start)
+					pushRangeVector(layers + NonLeadingTabsLayer, NSMakeRange(base + i, j - i));
+				i = j;
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
+	if (_enabled[LeadingSpacesLayer])
+	{
+		NSUInteger i = start;
+		while (i < end)
+		{
+			if (buffer[i] == '\t')
+			{
+				++i;
+			}
+			else if (buffer[i] == ' ')
+			{
+				NSUInteger j = i;
+				while (j < end && buffer[j] == ' ')
+					++j;
+
+				// Allow leading spaces before multi-line C-style comments. Otherwise we highlight
+				// spaces at the very start of a line and spaces between tabs, but not spaces
+				// following tabs.
+				unichar ch = j < end ? buffer[j] : '\n';
+				if (ch != '*' && (i == start || ch == '\t'))
+					pushRangeVector(layers + LeadingSpacesLayer, NSMakeRange(base + i, j - i));
+				i = j;
+			}
+			else
+			{
+				break;
+			}
+		}
+	}
+
+	if (_enabled[LongLinesLayer])
+	{
+		NSUInteger width = 0;
+		for (NSUInteger i = start; i < end; ++i)
+		{
+			width += buffer[i] == '\t' && _useTabWidth ? _tabWidth : 1;
+			if (width > _maxWidth)
+			{
+				pushRangeVector(layers + LongLinesLayer, NSMakeRange(base + i, end - i));
+				break;
+			}
+		}
+	}
+}
+
+@end
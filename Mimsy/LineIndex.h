@@ -0,0 +1,32 @@
+#import <Foundation/Foundation.h>
+
+/// Maps between offsets and line numbers for a text buffer and is updated as the
+/// text is edited. Line starts are kept in a gap buffer: the starts before the gap
+/// are offsets from the beginning of the text and the starts after the gap are
+/// offsets from the end of the text. So an edit only has to touch the lines which
+/// were edited (and move the gap, which is free when typing because the gap is
+/// already where the user is typing). Lookups are binary searches.
+///
+/// Only '\n' starts a new line (TextDocument normalizes line endings).
+@interface LineIndex : NSObject
+
+/// Called after text has been edited. range is the range of the new text and delta
+/// is the change in the length of the text (i.e. NSTextStorage's editedRange and
+/// changeInLength).
+- (void)edited:(NSString*)text range:(NSRange)range delta:(NSInteger)delta;
+
+/// Forces the index to be rebuilt the next time it is used.
+- (void)reset;
+
+/// Returns the number of lines. Note that this is at least one (even if the text
+/// is empty).
+- (NSUInteger)numLines:(NSString*)text;
+
+/// Returns the 0-based line that offset is within.
+- (NSUInteger)offsetToLine:(NSUInteger)offset text:(NSString*)text;
+
+/// Returns the offset of the start of a 0-based line or NSNotFound if line is too
+/// large.
+- (NSUInteger)lineToOffset:(NSUInteger)line text:(NSString*)text;
+
+@end
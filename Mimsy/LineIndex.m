@@ -0,0 +1,196 @@
+#import "LineIndex.h"
+
+#import "Assert.h"
+
+// Number of characters we copy out of the string at a time when looking for
+// new lines (characterAtIndex: is far too slow to call for every character).
+const NSUInteger ScanChunkSize = 1024;
+
+@implementation LineIndex
+{
+	NSUInteger* _data;
+	NSUInteger _capacity;
+	NSUInteger _gapStart;		// index of the first unused slot
+	NSUInteger _gapEnd;			// index of the first slot after the gap
+	NSUInteger _length;			// length of the text the index was built for
+	bool _valid;
+}
+
+- (id)init
+{
+	self = [super init];
+	if (self)
+	{
+		_capacity = 64;
+		_data = malloc(_capacity*sizeof(NSUInteger));
+		_gapEnd = _capacity;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	free(_data);
+}
+
+- (void)reset
+{
+	_valid = false;
+}
+
+- (void)edited:(NSString*)text range:(NSRange)range delta:(NSInteger)delta
+{
+	if (!_valid)
+		return;
+
+	// Edits should always be reported to us but if something was missed we'll
+	// rebuild the index from scratch instead of returning bad results.
+	NSUInteger oldLength = (NSUInteger) ((NSInteger) text.length - delta);
+	if (oldLength != _length || range.location + range.length > text.length || (NSInteger) range.length < delta)
+	{
+		_valid = false;
+		return;
+	}
+
+	// Remove the starts within the old text: these are one past a new line so a
+	// start at range.location isn't affected.
+	NSUInteger oldEnd = range.location + (NSUInteger) ((NSInteger) range.length - delta);
+	NSUInteger first = [self _lowerBound:range.location + 1];
+	NSUInteger last = [self _lowerBound:oldEnd + 1];
+	[self _moveGap:first];
+	_gapEnd += last - first;
+
+	// Starts after the gap are relative to the end so they don't need to change.
+	_length = text.length;
+	[self _addStarts:text range:range];
+}
+
+- (NSUInteger)numLines:(NSString*)text
+{
+	[self _validate:text];
+	return [self _count];
+}
+
+- (NSUInteger)offsetToLine:(NSUInteger)offset text:(NSString*)text
+{
+	[self _validate:text];
+
+	// The first start is always zero so this is at least one.
+	NSUInteger count = [self _lowerBound:offset + 1];
+	return count - 1;
+}
+
+- (NSUInteger)lineToOffset:(NSUInteger)line text:(NSString*)text
+{
+	[self _validate:text];
+	return line < [self _count] ? [self _startAt:line] : NSNotFound;
+}
+
+// Note that we don't rebuild if only the length has changed: that happens when
+// the index is used in the middle of a batch of edits (e.g. when toggling comments)
+// and the starts before the edits are still correct.
+- (void)_validate:(NSString*)text
+{
+	if (!_valid)
+	{
+		_gapStart = 0;
+		_gapEnd = _capacity;
+		_length = text.length;
+
+		[self _insertStart:0];
+		[self _addStarts:text range:NSMakeRange(0, text.length)];
+		_valid = true;
+	}
+}
+
+// Adds starts for the new lines within range. These must all be after the
+// starts before the gap and before the starts after the gap.
+- (void)_addStarts:(NSString*)text range:(NSRange)range
+{
+	unichar buffer[ScanChunkSize];
+
+	NSUInteger offset = range.location;
+	NSUInteger end = range.location + range.length;
+	while (offset < end)
+	{
+		NSUInteger count = MIN(end - offset, ScanChunkSize);
+		[text getCharacters:buffer range:NSMakeRange(offset, count)];
+
+		for (NSUInteger i = 0; i < count; ++i)
+		{
+			if (buffer[i] == '\n')
+				[self _insertStart:offset + i + 1];
+		}
+		offset += count;
+	}
+}
+
+- (void)_insertStart:(NSUInteger)start
+{
+	ASSERT(start <= _length);
+
+	if (_gapStart == _gapEnd)
+	{
+		NSUInteger newCapacity = 2*_capacity;
+		NSUInteger tail = _capacity - _gapEnd;
+		NSUInteger* data = malloc(newCapacity*sizeof(NSUInteger));
+		memcpy(data, _data, _gapStart*sizeof(NSUInteger));
+		memcpy(data + newCapacity - tail, _data + _gapEnd, tail*sizeof(NSUInteger));
+
+		free(_data);
+		_data = data;
+		_gapEnd = newCapacity - tail;
+		_capacity = newCapacity;
+	}
+
+	_data[_gapStart++] = start;
+}
+
+// Moves the gap so that it begins at the logical index.
+- (void)_moveGap:(NSUInteger)index
+{
+	ASSERT(index <= [self _count]);
+
+	while (_gapStart > index)
+	{
+		NSUInteger start = _data[--_gapStart];
+		_data[--_gapEnd] = _length - start;
+	}
+
+	while (_gapStart < index)
+	{
+		NSUInteger start = _length - _data[_gapEnd++];
+		_data[_gapStart++] = start;
+	}
+}
+
+- (NSUInteger)_count
+{
+	return _gapStart + (_capacity - _gapEnd);
+}
+
+- (NSUInteger)_startAt:(NSUInteger)index
+{
+	if (index < _gapStart)
+		return _data[index];
+	else
+		return _length - _data[index + (_gapEnd - _gapStart)];
+}
+
+// Returns the index of the first start which is not less than offset.
+- (NSUInteger)_lowerBound:(NSUInteger)offset
+{
+	NSUInteger lo = 0;
+	NSUInteger hi = [self _count];
+	while (lo < hi)
+	{
+		NSUInteger mid = lo + (hi - lo)/2;
+		if ([self _startAt:mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+@end
@@ -0,0 +1,11 @@
+#import <Foundation/Foundation.h>
+
+/// Compact version of StyleRun used to store runs once they have been
+/// computed. Runs are contiguous so lengths are implicit: a run extends
+/// to the start of the next run. Vectors of these are terminated by a
+/// sentinel run which starts at the end of the text.
+struct PackedRun
+{
+	uint32_t location;
+	uint8_t elementIndex;
+};
@@ -0,0 +1,69 @@
+// Generated using `./Mimsy/create-vector.py --element=struct PackedRun --struct=PackedRunVector --size=NSUInteger --headers=PackedRun.h` on 17 October 2026 10:12.
+#include "PackedRun.h"
+
+#import "Assert.h"
+#import <stdlib.h>		// for malloc and free
+#import <string.h>		// for memcpy
+
+struct PackedRunVector
+{
+	struct PackedRun* data;				// read/write
+	NSUInteger count;		// read-only
+	NSUInteger capacity;	// read-only
+};
+
+static inline struct PackedRunVector newPackedRunVector()
+{
+	struct PackedRunVector vector;
+
+	vector.capacity = 16;
+	vector.count = 0;
+	vector.data = malloc(vector.capacity*sizeof(struct PackedRun));
+
+	return vector;
+}
+
+static inline void freePackedRunVector(struct PackedRunVector* vector)
+{
+	// Vectors are often passed around via pointer because it should be
+	// slightly more efficient but typically are not heap allocated.
+	free(vector->data);
+}
+
+static inline void reservePackedRunVector(struct PackedRunVector* vector, NSUInteger capacity)
+{
+	ASSERT(vector->count <= vector->capacity);
+
+	if (capacity > vector->capacity)
+	{
+		struct PackedRun* data = calloc(capacity*sizeof(struct PackedRun), 1);	
+		memcpy(data, vector->data, vector->count*sizeof(struct PackedRun));
+
+		free(vector->data);
+		vector->data = data;
+		vector->capacity = capacity;
+	}
+}
+	
+/// If the vector is grown the new elements will be zero initialized.
+static inline void setSizePackedRunVector(struct PackedRunVector* vector, NSUInteger newSize)
+{
+	reservePackedRunVector(vector, newSize);
+	vector->count = newSize;
+}
+
+static inline void pushPackedRunVector(struct PackedRunVector* vector, struct PackedRun element)
+{
+	if (vector->count == vector->capacity)
+		reservePackedRunVector(vector, 2*vector->capacity);
+
+	ASSERT(vector->count < vector->capacity);
+	vector->data[vector->count++] = element;
+}
+
+static inline struct PackedRun popPackedRunVector(struct PackedRunVector* vector)
+{
+	ASSERT(vector->count > 0);
+	return vector->data[--vector->count];
+}
+
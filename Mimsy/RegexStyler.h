@@ -1,7 +1,8 @@
 #import <Foundation/Foundation.h>
+#import "RangeVector.h"
 #import "UIntVector.h"
 
-@class StyleRuns;
+@class StylerToken, StyleRuns;
 
 /// Computes style runs using regexen from a language file.
 @interface RegexStyler : NSObject
@@ -12,7 +13,29 @@
 
 - (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count;
 
+/// The methods below return nil if the token is cancelled before they finish.
+- (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count token:(StylerToken*)token;
+
+/// Splits text into chunks at line boundaries and styles the chunks concurrently.
+/// Runs which cross chunk boundaries (e.g. block comments) are patched up afterwards.
+- (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count chunks:(NSUInteger)numChunks token:(StylerToken*)token;
+
+/// Re-lexes only the text near an edit. Previous should be the runs computed for the
+/// text before the edit, edited the range within text that was changed, and delta the
+/// change in the text's length. Returns nil if the runs cannot be computed incrementally.
+- (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count previous:(StyleRuns*)previous edited:(NSRange)edited delta:(NSInteger)delta token:(StylerToken*)token;
+
+/// Lexes only the text around ranges (which must be sorted). Each window starts at a line
+/// start at least context characters before its range so a range within an element which
+/// began further back than that (e.g. a very long block comment) may be misclassified. Text
+/// outside the windows is given the normal style.
+- (StyleRuns*)computeStyles:(NSString*)text near:(const struct RangeVector*)ranges context:(NSUInteger)context;
+
 /// Index zero will be the normal style.
 @property (readonly) NSArray* names;
 
+/// Hash of the patterns and element names. If this is unchanged then the
+/// styler will compute the same runs for a given text.
+@property (readonly) uint64_t fingerprint;
+
 @end
@@ -1,7 +1,9 @@
 #import "RegexStyler.h"
 
+#import "AsyncStyler.h"
 #import "Logger.h"
 #import "StyleRuns.h"
+#import "Utils.h"
 
 @implementation RegexStyler
 {
@@ -15,10 +17,27 @@
 	
 	_regexen = regexen;
 	_names = names;
+	_fingerprint = [self _computeFingerprint];
 	
 	return self;
 }
 
+- (uint64_t)_computeFingerprint
+{
+	uint64_t hash = FNVOffsetBasis;
+	for (NSRegularExpression* re in _regexen)
+	{
+		hash = hashString(hash, re.pattern);
+		hash = hashString(hash, [NSString stringWithFormat:@"\n%lu\n", (unsigned long) re.options]);
+	}
+	for (NSString* name in _names)
+	{
+		hash = hashString(hash, name);
+		hash = hashString(hash, @"\n");
+	}
+	return hash;
+}
+
 // threaded
 static int compareRun(const void* inLhs, const void* inRhs)
 {
@@ -55,34 +74,348 @@ static int compareIntersections(const void* inLhs, const void* inRhs)
     return 0;
 }
 
+// threaded
+static NSUInteger nextLineStart(NSString* text, NSUInteger loc)
+{
+    if (loc == 0 || loc >= text.length || [text characterAtIndex:loc-1] == '\n')
+        return loc;
+    
+    return NSMaxRange([text lineRangeForRange:NSMakeRange(loc, 0)]);
+}
+
+// Returns the run containing loc (runs must be sorted and not overlap).
+// threaded
+static const struct StyleRun* findRun(const struct StyleRunVector* runs, NSUInteger loc)
+{
+    NSUInteger lo = 0;
+    NSUInteger hi = runs->count;
+    while (lo < hi)
+    {
+        NSUInteger mid = (lo + hi)/2;
+        const struct StyleRun* run = runs->data + mid;
+        if (loc < run->range.location)
+            hi = mid;
+        else if (loc >= NSMaxRange(run->range))
+            lo = mid + 1;
+        else
+            return run;
+    }
+    return NULL;
+}
+
+// Returns the range of the non-normal run containing loc (or NSNotFound).
+typedef NSRange (^ReferenceRun)(NSUInteger loc);
+
+// Appends run filling in any gap before it with a Normal run.
+// threaded
+static void appendRun(struct StyleRunVector* runs, struct StyleRun run)
+{
+    NSUInteger end = runs->count > 0 ? NSMaxRange(runs->data[runs->count-1].range) : 0;
+    if (end < run.range.location)
+        pushStyleRunVector(runs, (struct StyleRun) {.elementIndex = 0, .range = NSMakeRange(end, run.range.location - end)});
+    if (run.range.length > 0)
+        pushStyleRunVector(runs, run);
+}
+
 // threaded
 - (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count
 {
+    return [self computeStyles:text editCount:count token:nil];
+}
+
+// threaded
+- (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count token:(StylerToken*)token
+{
+	// Note that we don't reserve space for runs up front: these are only temporary
+	// (StyleRuns packs them) but can be large for large documents.
 	__block struct StyleRunVector runs = newStyleRunVector();
-	reserveStyleRunVector(&runs, 2*text.length/40);	// this is how many runs I had in a screen of random rust code (x2 because of Normal runs)
     
-    for (NSUInteger i = 0; i < _regexen.count; ++i)
+    [self _matchRange:NSMakeRange(0, text.length) text:text runs:&runs token:token];
+    if (token.cancelled)
     {
-        NSRegularExpression* re = _regexen[i];
-        [self _matchRegex:re runs:&runs index:i text:text];
+        freeStyleRunVector(&runs);
+        return nil;
     }
-    
     [self _insertNormalStyles:&runs text:text];
 		
 	return [[StyleRuns alloc] initWithElementNames:_names runs:runs editCount:count];
 }
 
 // threaded
-- (void) _matchRegex:(NSRegularExpression*)re runs:(struct StyleRunVector*)runs index:(NSUInteger)index text:(NSString*)text
+- (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count chunks:(NSUInteger)numChunks token:(StylerToken*)token
+{
+    ASSERT(numChunks > 0);
+    double startTime = getTime();
+    
+    NSUInteger* starts = malloc((numChunks + 1)*sizeof(NSUInteger));
+    starts[0] = 0;
+    for (NSUInteger i = 1; i < numChunks; ++i)
+        starts[i] = MAX(starts[i-1], nextLineStart(text, i*(text.length/numChunks)));
+    starts[numChunks] = text.length;
+    
+    struct StyleRunVector* chunks = malloc(numChunks*sizeof(struct StyleRunVector));
+    dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(numChunks, concurrent,
+        ^(size_t i)
+        {
+            chunks[i] = newStyleRunVector();
+            [self _matchRange:NSMakeRange(starts[i], starts[i+1] - starts[i]) text:text runs:chunks + i token:token];
+        });
+    if (token.cancelled)
+    {
+        for (NSUInteger i = 0; i < numChunks; ++i)
+            freeStyleRunVector(chunks + i);
+        free(chunks);
+        free(starts);
+        return nil;
+    }
+    
+    struct StyleRunVector runs = newStyleRunVector();
+    NSUInteger total = 0;
+    for (NSUInteger i = 0; i < numChunks; ++i)
+        total += chunks[i].count;
+    reserveStyleRunVector(&runs, 2*total);
+    
+    // Each chunk was lexed as if it started outside of any run. If a run from an earlier
+    // chunk extends into a chunk then we need to re-lex the chunk from where the run ends
+    // until we get back in sync with the chunk's runs.
+    NSUInteger relexed = 0;
+    for (NSUInteger i = 0; i < numChunks; ++i)
+    {
+        NSUInteger covered = runs.count > 0 ? NSMaxRange(runs.data[runs.count-1].range) : 0;
+        NSUInteger resume = MAX(covered, relexed);
+        if (resume > starts[i])
+        {
+            const struct StyleRunVector* chunk = chunks + i;
+            ReferenceRun reference = ^NSRange(NSUInteger loc)
+            {
+                const struct StyleRun* run = findRun(chunk, loc);
+                return run && run->elementIndex > 0 ? run->range : NSMakeRange(NSNotFound, 0);
+            };
+            
+            struct StyleRunVector repaired = newStyleRunVector();
+            relexed = [self _relex:text from:resume minStop:resume reference:reference delta:0 runs:&repaired token:token];
+            for (NSUInteger j = 0; j < repaired.count; ++j)
+                pushStyleRunVector(&runs, repaired.data[j]);
+            freeStyleRunVector(&repaired);
+            LOG("Text:Styler:Verbose", "Re-lexed %lu characters at the start of chunk %lu", relexed - resume, i);
+        }
+        
+        for (NSUInteger j = 0; j < chunks[i].count; ++j)
+        {
+            if (chunks[i].data[j].range.location >= relexed)
+                pushStyleRunVector(&runs, chunks[i].data[j]);
+        }
+        freeStyleRunVector(chunks + i);
+    }
+    free(chunks);
+    free(starts);
+    
+    [self _insertNormalStyles:&runs text:text];
+    
+    double elapsed = getTime() - startTime;
+    LOG("Text:Styler:Verbose", "Styled %.1f KiB using %lu chunks in %.1fms", text.length/1024.0, numChunks, 1000*elapsed);
+    
+	return [[StyleRuns alloc] initWithElementNames:_names runs:runs editCount:count];
+}
+
+// Re-lexing the entire document on every edit gets very slow for large documents
+// so, when we can, we re-lex only a window around the edit and splice the results
+// into the runs from the previous styler pass. The window starts at a line start
+// that isn't inside a multi-line element and is grown until both the new runs and
+// the previous runs have a boundary at a line start past the edit.
+// threaded
+- (StyleRuns*)computeStyles:(NSString*)text editCount:(NSUInteger)count previous:(StyleRuns*)previous edited:(NSRange)edited delta:(NSInteger)delta token:(StylerToken*)token
+{
+    const struct PackedRunVector* old = previous.vector;
+    NSUInteger oldCount = countPackedRuns(old);
+    if (oldCount == 0 || NSMaxRange(edited) > text.length)
+        return nil;
+    
+    double startTime = getTime();
+    ReferenceRun reference = ^NSRange(NSUInteger loc)
+    {
+        NSUInteger index = searchPackedRuns(old, loc);
+        if (index < oldCount && old->data[index].elementIndex > 0 && old->data[index].location <= loc)
+            return rangeOfPackedRun(old, index);
+        return NSMakeRange(NSNotFound, 0);
+    };
+    NSUInteger start = [self _resyncStart:edited.location text:text reference:reference];
+    
+    struct StyleRunVector window = newStyleRunVector();
+    NSUInteger stop = [self _relex:text from:start minStop:NSMaxRange(edited) reference:reference delta:delta runs:&window token:token];
+    if (token.cancelled)
+    {
+        freeStyleRunVector(&window);
+        return nil;
+    }
+    
+    struct StyleRunVector runs = newStyleRunVector();
+    reserveStyleRunVector(&runs, oldCount + window.count);
+    
+    // Runs before the window are unchanged,
+    NSUInteger i = 0;
+    for (; i < oldCount && old->data[i+1].location <= start; ++i)
+    {
+        if (old->data[i].elementIndex > 0)
+            appendRun(&runs, (struct StyleRun) {.elementIndex = old->data[i].elementIndex, .range = rangeOfPackedRun(old, i)});
+    }
+    
+    // then the runs within the window,
+    for (NSUInteger j = 0; j < window.count; ++j)
+        appendRun(&runs, window.data[j]);
+    
+    // and the runs after the window have only moved.
+    for (; i < oldCount; ++i)
+    {
+        struct StyleRun run = {.elementIndex = old->data[i].elementIndex, .range = rangeOfPackedRun(old, i)};
+        if (run.elementIndex > 0 && (NSInteger) run.range.location + delta >= (NSInteger) stop)
+        {
+            run.range.location = (NSUInteger) ((NSInteger) run.range.location + delta);
+            appendRun(&runs, run);
+        }
+    }
+    
+    if (runs.count > 0)
+        appendRun(&runs, (struct StyleRun) {.elementIndex = 0, .range = NSMakeRange(text.length, 0)});
+    
+    double elapsed = getTime() - startTime;
+    LOG("Text:Styler:Verbose", "Restyled %lu of %lu characters in %.1fms", stop - start, text.length, 1000*elapsed);
+    freeStyleRunVector(&window);
+    
+    return [[StyleRuns alloc] initWithElementNames:_names runs:runs editCount:count];
+}
+
+// threaded
+- (StyleRuns*)computeStyles:(NSString*)text near:(const struct RangeVector*)ranges context:(NSUInteger)context
+{
+    double startTime = getTime();
+    struct StyleRunVector runs = newStyleRunVector();
+    struct StyleRunVector window = newStyleRunVector();
+    
+    NSUInteger i = 0;
+    NSUInteger lexed = 0;       // runs cover the text before this
+    NSUInteger total = 0;
+    while (i < ranges->count)
+    {
+        NSRange range = ranges->data[i];
+        NSUInteger start = [text lineRangeForRange:NSMakeRange(range.location > context ? range.location - context : 0, 0)].location;
+        NSUInteger stop = nextLineStart(text, MIN(text.length, NSMaxRange(range)));
+        
+        // Ranges whose windows overlap are lexed together.
+        for (++i; i < ranges->count && ranges->data[i].location <= stop + context; ++i)
+            stop = MAX(stop, nextLineStart(text, MIN(text.length, NSMaxRange(ranges->data[i]))));
+        
+        // A run from the previous window may extend into this one.
+        start = MAX(start, lexed);
+        if (start < stop)
+        {
+            setSizeStyleRunVector(&window, 0);
+            [self _matchRange:NSMakeRange(start, stop - start) text:text runs:&window token:nil];
+            for (NSUInteger j = 0; j < window.count; ++j)
+                pushStyleRunVector(&runs, window.data[j]);
+            
+            lexed = window.count > 0 ? MAX(stop, NSMaxRange(window.data[window.count-1].range)) : stop;
+            total += stop - start;
+        }
+    }
+    freeStyleRunVector(&window);
+    [self _insertNormalStyles:&runs text:text];
+    
+    double elapsed = getTime() - startTime;
+    LOG("Text:Styler:Verbose", "Styled %lu of %lu characters around %lu ranges in %.1fms", total, text.length, ranges->count, 1000*elapsed);
+    
+    return [[StyleRuns alloc] initWithElementNames:_names runs:runs editCount:0];
+}
+
+// Returns the start of a line at or before loc which isn't within a multi-line run.
+// threaded
+- (NSUInteger)_resyncStart:(NSUInteger)loc text:(NSString*)text reference:(ReferenceRun)reference
+{
+    NSUInteger start = MIN(loc, text.length);
+    while (true)
+    {
+        start = [text lineRangeForRange:NSMakeRange(start, 0)].location;
+        if (start == 0)
+            break;
+        
+        NSRange run = reference(start);
+        if (run.location < start)
+            start = run.location;
+        else
+            break;
+    }
+    return start;
+}
+
+// Lexes text starting at start and returns the line start (at or after minStop) where
+// the new runs and the reference runs (offset by delta) agree that no run spans the
+// location. Runs are the non-normal runs for [start, returned value).
+// threaded
+- (NSUInteger)_relex:(NSString*)text from:(NSUInteger)start minStop:(NSUInteger)minStop reference:(ReferenceRun)reference delta:(NSInteger)delta runs:(struct StyleRunVector*)runs token:(StylerToken*)token
+{
+    NSUInteger stop = nextLineStart(text, minStop);
+    while (!token.cancelled)
+    {
+        setSizeStyleRunVector(runs, 0);
+        [self _matchRange:NSMakeRange(start, stop - start) text:text runs:runs token:token];
+        
+        // New runs may extend past the end of the window (e.g. if the user typed
+        // the start of a block comment),
+        NSUInteger candidate = stop;
+        if (runs->count > 0)
+            candidate = MAX(candidate, nextLineStart(text, NSMaxRange(runs->data[runs->count-1].range)));
+        
+        // and so may the old runs (e.g. if the user deleted the start of a block comment).
+        NSInteger oldLoc = (NSInteger) candidate - delta;
+        if (oldLoc >= 0)
+        {
+            NSRange run = reference((NSUInteger) oldLoc);
+            if (run.location < (NSUInteger) oldLoc)
+                candidate = nextLineStart(text, MIN(text.length, (NSUInteger) ((NSInteger) NSMaxRange(run) + delta)));
+        }
+        
+        if (candidate == stop || stop >= text.length)
+            break;
+        
+        // Grow the window geometrically so that the re-lexing doesn't go quadratic.
+        stop = nextLineStart(text, MIN(text.length, MAX(candidate, start + 2*(stop - start))));
+    }
+    return stop;
+}
+
+// Adds non-normal matches which start within range (but may extend past it).
+// threaded
+- (void)_matchRange:(NSRange)range text:(NSString*)text runs:(struct StyleRunVector*)runs token:(StylerToken*)token
+{
+    for (NSUInteger i = 0; i < _regexen.count && !token.cancelled; ++i)
+    {
+        NSRegularExpression* re = _regexen[i];
+        [self _matchRegex:re runs:runs index:i text:text range:range token:token];
+    }
+}
+
+// threaded
+- (void) _matchRegex:(NSRegularExpression*)re runs:(struct StyleRunVector*)runs index:(NSUInteger)index text:(NSString*)text range:(NSRange)within token:(StylerToken*)token
 {
     NSUInteger count = runs->count;
-    [re enumerateMatchesInString:text options:0 range:NSMakeRange(0, text.length) usingBlock:
-     ^(NSTextCheckingResult* match, NSMatchingFlags flags, BOOL* stop)
+    NSUInteger stop = NSMaxRange(within);
+    
+    // Transparent bounds so that anchors and look behind work when we're lexing a window.
+    [re enumerateMatchesInString:text options:NSMatchingWithTransparentBounds range:NSMakeRange(within.location, text.length - within.location) usingBlock:
+     ^(NSTextCheckingResult* match, NSMatchingFlags flags, BOOL* stopped)
      {
          (void) flags;
-         (void) stop;
+         
+         if (match.range.location >= stop || token.cancelled)
+         {
+             *stopped = YES;
+             return;
+         }
          
          NSRange range = re.numberOfCaptureGroups == 0 ? [match rangeAtIndex:0] : [match rangeAtIndex:1];
+         if (range.location == NSNotFound)
+             return;     // the capture group didn't participate in the match
          struct StyleRun run = {.elementIndex = index+1, .range = range};
          
          struct StyleRun* intersects = (struct StyleRun*) bsearch(&run, runs->data, count, sizeof(struct StyleRun), compareIntersections);
@@ -44,8 +44,13 @@
 	_openFiles = [self _findMatchingOpenFiles];
 	if ([self.root.asString compare:@"Open Windows"] != NSOrderedSame)
 	{
+		// The walk blocks once the work queue fills up so it can't be done on the main thread.
 		++_numThreads;
-		[self _step2FindPaths];
+		dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+		dispatch_async(concurrent,
+		   ^{
+			   [self _step2FindPaths];
+		   });
 	}
 	[self _processOpenfiles];
 }
@@ -69,26 +74,108 @@
 	return openFiles;
 }
 
-// Kind of sucks to process all the open files in the main thread but it's tricky
-// to handle by processing the files on disk, especially if the user is also
-// editing the files. And also doing it in the main thread allows us to support
-// undo within the open files.
+// Open files have to be edited in the main thread: the user may also be editing them
+// and it allows us to support undo within the open files. But finding the matches and
+// expanding the template doesn't have to be done there so we do that concurrently using
+// a snapshot of each document's text and then splice the replacements in on the main
+// thread.
 - (void)_processOpenfiles
 {
+	dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	dispatch_queue_t main = dispatch_get_main_queue();
+	
 	for (NSString* path in _openFiles)
 	{
-		NSUInteger numMatches = replaceAll(_findController, _openFiles[path], self.regex, _template);
-		if (numMatches > 0)
-		{
-			OSAtomicIncrement32(&_numFiles);
-			OSAtomicAdd32Barrier((int32_t) numMatches, &_numMatches);
-		}
+		TextController* controller = _openFiles[path];
+		NSString* text = [controller.text copy];
+		NSUInteger editCount = controller.editCount;
+		
+		++_numThreads;
+		dispatch_async(concurrent,
+			^{
+				NSMutableArray* matches = [NSMutableArray new];
+				NSMutableArray* replacements = [NSMutableArray new];
+				[self.regex enumerateMatchesInString:text options:0 range:NSMakeRange(0, text.length) usingBlock:
+					^(NSTextCheckingResult *match, NSMatchingFlags flags, BOOL *stop)
+					{
+						UNUSED(flags, stop);
+						if (match)
+						{
+							[matches addObject:match];
+							[replacements addObject:[self.regex replacementStringForResult:match inString:text offset:0 template:self->_template]];
+						}
+					}];
+				
+				dispatch_async(main,
+					^{
+						[self _replaceIn:controller editCount:editCount matches:matches replacements:replacements];
+						if (--self->_numThreads == 0)
+							[self _finishedReplacing];
+					});
+			});
 	}
 	
 	if (--_numThreads == 0)
 		[self _finishedReplacing];
 }
 
+- (void)_replaceIn:(TextController*)controller editCount:(NSUInteger)editCount matches:(NSArray*)matches replacements:(NSArray*)replacements
+{
+	NSUInteger numMatches = 0;
+	
+	if (controller.closed)
+	{
+		LOG("Find:Verbose", "Skipping replace in %s (it was closed)", STR(controller.path));
+	}
+	else if (controller.editCount != editCount)
+	{
+		// The document was edited after we grabbed its text so the matches may be
+		// stale. This is rare so we just fall back to replacing the slow way.
+		LOG("Find:Verbose", "Replacing within %s on the main thread (it was edited)", STR(controller.path));
+		numMatches = replaceAll(_findController, controller, self.regex, _template);
+	}
+	else if (matches.count > 0)
+	{
+		NSMutableArray* ranges = [NSMutableArray arrayWithCapacity:matches.count];
+		NSMutableArray* strings = [NSMutableArray arrayWithCapacity:matches.count];
+		for (NSUInteger i = 0; i < matches.count; ++i)
+		{
+			NSTextCheckingResult* match = matches[i];
+			if ([_findController _rangeMatches:match.range controller:controller])
+			{
+				[ranges addObject:[NSValue valueWithRange:match.range]];
+				[strings addObject:replacements[i]];
+			}
+		}
+		
+		// The replacements are made as a single edit so there's one undo action and
+		// one round of edit processing no matter how many matches there are.
+		NSTextView* view = controller.textView;
+		if (ranges.count > 0)
+		{
+			[view.undoManager beginUndoGrouping];
+			if ([view shouldChangeTextInRanges:ranges replacementStrings:strings])
+			{
+				NSTextStorage* storage = view.textStorage;
+				[storage beginEditing];
+				for (NSUInteger i = ranges.count - 1; i < ranges.count; --i)
+					[storage replaceCharactersInRange:[ranges[i] rangeValue] withString:strings[i]];
+				[storage endEditing];
+				[view didChangeText];
+				numMatches = ranges.count;
+			}
+			[view.undoManager endUndoGrouping];
+			[view.undoManager setActionName:@"Replace All"];
+		}
+	}
+	
+	if (numMatches > 0)
+	{
+		OSAtomicIncrement32(&_numFiles);
+		OSAtomicAdd32Barrier((int32_t) numMatches, &_numMatches);
+	}
+}
+
 - (bool)_processPath:(MimsyPath*)path withContents:(NSMutableString*)contents	// threaded
 {
 	bool edited = false;
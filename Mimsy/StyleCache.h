@@ -0,0 +1,25 @@
+#import <Foundation/Foundation.h>
+#import "MimsyPlugins.h"
+
+@class Language, StyleRuns;
+
+/// Persists the style runs computed for large documents so that when the
+/// document is re-opened it can be fully colored without running the styler.
+/// Runs are stored in flat files within the caches directory which are memory
+/// mapped back into StyleRuns. Entries are keyed by path, file size, mtime,
+/// language name, and the language's patterns.
+@interface StyleCache : NSObject
+
++ (void)setup;
+
+/// Returns nil if there are no cached runs for the file or if they are stale.
+/// Length is the length of the document's text which must match the length of
+/// the text the runs were computed for.
++ (StyleRuns*)loadRuns:(MimsyPath*)path language:(Language*)lang length:(NSUInteger)length editCount:(NSUInteger)count;
+
+/// Modified should be the document's modification date: if the file has been
+/// changed on disk since then the runs are not saved. Runs must have been computed
+/// for the unedited document. The file is written on a background thread.
++ (void)saveRuns:(StyleRuns*)runs path:(MimsyPath*)path language:(Language*)lang length:(NSUInteger)length modified:(NSDate*)modified;
+
+@end
@@ -0,0 +1,211 @@
+#import "StyleCache.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#import "Language.h"
+#import "Logger.h"
+#import "Paths.h"
+#import "RegexStyler.h"
+#import "StyleRuns.h"
+#import "Utils.h"
+
+// Smaller documents are styled quickly enough that it's not worth cluttering
+// up the caches directory with them.
+const NSUInteger MinCachedLength = 64*1024;
+
+// Entries which haven't been used for this long are removed on startup.
+const NSTimeInterval MaxCachedAge = 30*24*60*60.0;
+
+const uint32_t CacheMagic = 0x4E55524D;		// "MRUN"
+const uint32_t CacheVersion = 1;
+
+// An entry is this header followed by the packed runs (including the sentinel).
+// The header is a multiple of 8 bytes so the runs can be used directly from the
+// mapped file.
+struct CacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;			// hash of the path, language name, and styler fingerprint
+	uint64_t fileSize;
+	int64_t mtimeSecs;
+	int64_t mtimeNanos;
+	uint64_t textLength;
+	uint64_t numNames;
+	uint64_t numRuns;
+};
+
+static NSString* _dir;
+
+@implementation StyleCache
+
++ (void)setup
+{
+	ASSERT(_dir == nil);
+
+	if (Paths.caches)
+	{
+		NSString* dir = [Paths.caches stringByAppendingPathComponent:@"StyleRuns"];
+
+		NSError* error = nil;
+		NSFileManager* fm = [NSFileManager defaultManager];
+		if ([fm createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:&error])
+		{
+			_dir = dir;
+
+			dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+			dispatch_async(concurrent, ^{[StyleCache _prune:dir];});
+		}
+		else
+		{
+			LOG("Error", "Couldn't create '%s': %s", STR(dir), STR([error localizedFailureReason]));
+		}
+	}
+}
+
+// threaded
++ (void)_prune:(NSString*)dir
+{
+	NSFileManager* fm = [NSFileManager new];
+	NSArray* names = [fm contentsOfDirectoryAtPath:dir error:NULL];
+	for (NSString* name in names)
+	{
+		NSString* file = [dir stringByAppendingPathComponent:name];
+		NSDictionary* attrs = [fm attributesOfItemAtPath:file error:NULL];
+		NSDate* date = attrs.fileModificationDate;
+		if (date && -date.timeIntervalSinceNow > MaxCachedAge)
+		{
+			LOG("Text:Styler:Verbose", "Removing stale style cache entry %s", STR(name));
+			[fm removeItemAtPath:file error:NULL];
+		}
+	}
+}
+
+static uint64_t computeKey(MimsyPath* path, Language* lang)
+{
+	uint64_t hash = FNVOffsetBasis;
+	hash = hashString(hash, path.asString);
+	hash = hashString(hash, lang.name);
+
+	uint64_t fingerprint = lang.styler.fingerprint;
+	return hashBytes(hash, &fingerprint, sizeof(fingerprint));
+}
+
+// Entries are named using just the path so that a file has at most one entry.
+static NSString* entryPath(MimsyPath* path)
+{
+	uint64_t hash = hashString(FNVOffsetBasis, path.asString);
+	NSString* name = [NSString stringWithFormat:@"%016llx.runs", hash];
+	return [_dir stringByAppendingPathComponent:name];
+}
+
+// The runs are used to index into style arrays so we can't trust them blindly.
+static bool validRuns(const struct PackedRun* runs, uint64_t count, uint64_t length, uint64_t numNames)
+{
+	if (count < 2 || runs[0].location != 0 || runs[count-1].location != length)
+		return false;
+
+	for (uint64_t i = 0; i + 1 < count; ++i)
+	{
+		if (runs[i].elementIndex >= numNames || runs[i+1].location < runs[i].location)
+			return false;
+	}
+
+	return true;
+}
+
++ (StyleRuns*)loadRuns:(MimsyPath*)path language:(Language*)lang length:(NSUInteger)length editCount:(NSUInteger)count
+{
+	if (!_dir || length < MinCachedLength)
+		return nil;
+
+	struct stat state;
+	if (stat(path.asString.UTF8String, &state) != 0)
+		return nil;
+
+	NSString* file = entryPath(path);
+	NSData* data = [NSData dataWithContentsOfFile:file options:NSDataReadingMappedAlways error:NULL];
+	if (!data)
+		return nil;		// usually because the file has never been cached
+
+	NSArray* names = lang.styler.names;
+	const struct CacheHeader* header = data.bytes;
+	if (data.length < sizeof(struct CacheHeader) ||
+		header->magic != CacheMagic ||
+		header->version != CacheVersion ||
+		header->key != computeKey(path, lang) ||
+		header->fileSize != (uint64_t) state.st_size ||
+		header->mtimeSecs != state.st_mtimespec.tv_sec ||
+		header->mtimeNanos != state.st_mtimespec.tv_nsec ||
+		header->textLength != length ||
+		header->numNames != names.count)
+	{
+		LOG("Text:Styler:Verbose", "Style cache entry for %s is stale", STR(path.lastComponent));
+		return nil;
+	}
+
+	const struct PackedRun* runs = (const struct PackedRun*) (header + 1);
+	if ((data.length - sizeof(struct CacheHeader))/sizeof(struct PackedRun) != header->numRuns ||
+		!validRuns(runs, header->numRuns, length, names.count))
+	{
+		LOG("Error", "Removing corrupt style cache entry for %s", STR(path));
+		[[NSFileManager defaultManager] removeItemAtPath:file error:NULL];
+		return nil;
+	}
+
+	utimes(file.UTF8String, NULL);		// so that _prune knows it's still in use
+
+	LOG("Text:Styler", "Loaded %llu cached runs for %s", header->numRuns - 1, STR(path.lastComponent));
+	return [[StyleRuns alloc] initWithElementNames:names packed:runs count:header->numRuns backing:data editCount:count];
+}
+
++ (void)saveRuns:(StyleRuns*)runs path:(MimsyPath*)path language:(Language*)lang length:(NSUInteger)length modified:(NSDate*)modified
+{
+	if (!_dir || length < MinCachedLength || runs.vector->count == 0 || !modified)
+		return;
+
+	uint64_t key = computeKey(path, lang);
+	uint64_t numNames = lang.styler.names.count;
+	NSString* file = entryPath(path);
+
+	dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+	dispatch_async(concurrent, ^{
+		struct stat state;
+		if (stat(path.asString.UTF8String, &state) != 0)
+			return;
+
+		// If the file changed on disk after the document was loaded the runs won't
+		// match the new contents.
+		double mtime = state.st_mtimespec.tv_sec + 1.0e-9*state.st_mtimespec.tv_nsec;
+		if (fabs(mtime - modified.timeIntervalSince1970) > 0.001)
+		{
+			LOG("Text:Styler:Verbose", "Not caching runs for %s: the file has changed", STR(path.lastComponent));
+			return;
+		}
+
+		const struct PackedRunVector* vector = runs.vector;
+		struct CacheHeader header = {
+			.magic = CacheMagic,
+			.version = CacheVersion,
+			.key = key,
+			.fileSize = (uint64_t) state.st_size,
+			.mtimeSecs = state.st_mtimespec.tv_sec,
+			.mtimeNanos = state.st_mtimespec.tv_nsec,
+			.textLength = length,
+			.numNames = numNames,
+			.numRuns = vector->count};
+
+		NSMutableData* data = [NSMutableData dataWithCapacity:sizeof(header) + vector->count*sizeof(struct PackedRun)];
+		[data appendBytes:&header length:sizeof(header)];
+		[data appendBytes:vector->data length:vector->count*sizeof(struct PackedRun)];
+
+		NSError* error = nil;
+		if ([data writeToFile:file options:NSDataWritingAtomic error:&error])
+			LOG("Text:Styler:Verbose", "Cached %lu runs for %s", vector->count - 1, STR(path.lastComponent));
+		else
+			LOG("Error", "Couldn't write '%s': %s", STR(file), STR([error localizedFailureReason]));
+	});
+}
+
+@end
@@ -1,4 +1,5 @@
 #import <Foundation/Foundation.h>
+#import "PackedRunVector.h"
 #import "StyleRunVector.h"
 
 typedef id (^ElementToStyle)(NSString* elementName);
@@ -6,34 +7,76 @@ typedef id (^ElementToStyle)(NSString* elementName);
 typedef void (^ProcessStyleRun)(NSUInteger elementIndex, id style, NSRange range, bool* stop);
 typedef void (^ProcessStyleIndex)(NSUInteger elementIndex, NSRange range, bool* stop);
 
-/// Style runs computed for a text document. Once constructed it
-/// should only be used by the main thread. Note that there will
-//// be a style for every piece of text (text that doesn't match
-// a language regex will be given the "Normal" style).
+/// Number of runs in a packed vector (not counting the sentinel).
+static inline NSUInteger countPackedRuns(const struct PackedRunVector* runs)
+{
+	return runs->count > 0 ? runs->count - 1 : 0;
+}
+
+static inline NSRange rangeOfPackedRun(const struct PackedRunVector* runs, NSUInteger index)
+{
+	DEBUG_ASSERT(index + 1 < runs->count);
+	return NSMakeRange(runs->data[index].location, runs->data[index+1].location - runs->data[index].location);
+}
+
+/// Returns the index of the first run which ends after loc (or the number
+/// of runs if there is no such run).
+static inline NSUInteger searchPackedRuns(const struct PackedRunVector* runs, NSUInteger loc)
+{
+	NSUInteger lo = 0;
+	NSUInteger hi = countPackedRuns(runs);
+	while (lo < hi)
+	{
+		NSUInteger mid = (lo + hi)/2;
+		if (runs->data[mid+1].location <= loc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/// Style runs computed for a text document. The runs are not changed after
+/// construction so they may be read from any thread but mapElementsToStyles
+/// should only be called from the main thread. Note that there will be a style
+/// for every piece of text (text that doesn't match a language regex will be
+/// given the "Normal" style).
 @interface StyleRuns : NSObject
 
+/// Runs must be sorted and contiguous. They are packed into a compact form
+/// and then freed.
 - (id)initWithElementNames:(NSArray*)names runs:(struct StyleRunVector)runs editCount:(NSUInteger)count;
 
+/// Uses already packed runs (including the sentinel) without copying them. Backing
+/// is retained for as long as the runs are in use, e.g. a memory mapped file.
+- (id)initWithElementNames:(NSArray*)names packed:(const struct PackedRun*)runs count:(NSUInteger)count backing:(NSData*)backing editCount:(NSUInteger)editCount;
+
 /// The version of the document these runs were computed for.
 @property (readonly) NSUInteger editCount;
 
-/// The number of unprocessed runs.
-@property (readonly) NSUInteger length;
+/// All of the runs. These are not changed after construction so this may
+/// be used from threads. Use the PackedRun functions above to access them.
+@property (readonly) const struct PackedRunVector* vector;
 
 /// Pre-computes style information (usually an NSDictionary) for
 /// each element name.
 - (void)mapElementsToStyles:(ElementToStyle)block;
 
+/// The styles computed by mapElementsToStyles indexed by element index
+/// (nil if mapElementsToStyles hasn't been called).
+@property (readonly) NSArray* styles;
+
 - (NSString*)indexToName:(NSUInteger)index;
 
 /// This is O(N).
 - (NSUInteger)nameToIndex:(NSString*)name;
 
-/// Calls block until there are no more unprocessed runs or stop
-/// is set. As a side effect length is adjusted by the number of
-/// times block was called.
+/// Calls block for each run until there are no more runs or stop is set.
 - (void)process:(ProcessStyleRun)block;
 
+/// Calls block for the runs which intersect range.
+- (void)processRange:(NSRange)range block:(ProcessStyleRun)block;
+
 /// Live the above except that styles are not passed into the block.
 - (void)processIndexes:(ProcessStyleIndex)block;
 
@@ -5,29 +5,72 @@
 	NSArray* _names;
 	NSArray* _styles;
 	ElementToStyle _styler;
-	struct StyleRunVector _runs;
-	NSUInteger _processed;
+	struct PackedRunVector _runs;
+	NSData* _backing;		// if set _runs points into this
 	NSUInteger _oldOffset;
 }
 
 - (id)initWithElementNames:(NSArray*)names runs:(struct StyleRunVector)runs editCount:(NSUInteger)count
 {
+	ASSERT(names.count <= UINT8_MAX + 1);
+	
 	_names = names;
 	_styles = nil;		// set from the main thread via mapElementsToStyles
-	_runs = runs;
 	_editCount = count;
+	
+	// A StyleRun is 24 bytes and a PackedRun is 8 which adds up for large documents
+	// (especially because the text storage uses the runs for its syntax attributes).
+	_runs = newPackedRunVector();
+	if (runs.count > 0)
+	{
+		reservePackedRunVector(&_runs, runs.count + 1);
+		for (NSUInteger i = 0; i < runs.count; ++i)
+		{
+			DEBUG_ASSERT(i == 0 || runs.data[i].range.location == NSMaxRange(runs.data[i-1].range));
+			pushPackedRunVector(&_runs, (struct PackedRun) {.location = (uint32_t) runs.data[i].range.location, .elementIndex = (uint8_t) runs.data[i].elementIndex});
+		}
+		
+		NSUInteger end = NSMaxRange(runs.data[runs.count-1].range);
+		ASSERT(end <= UINT32_MAX);
+		pushPackedRunVector(&_runs, (struct PackedRun) {.location = (uint32_t) end, .elementIndex = 0});
+	}
+	freeStyleRunVector(&runs);
+	
+	return self;
+}
+
+- (id)initWithElementNames:(NSArray*)names packed:(const struct PackedRun*)runs count:(NSUInteger)count backing:(NSData*)backing editCount:(NSUInteger)editCount
+{
+	ASSERT(names.count <= UINT8_MAX + 1);
+	ASSERT(count != 1);		// runs should be empty or have a sentinel
+	
+	_names = names;
+	_styles = nil;
+	_editCount = editCount;
+	
+	// The vector is never changed after construction so it's OK to alias the data.
+	_backing = backing;
+	_runs.data = (struct PackedRun*) runs;
+	_runs.count = count;
+	_runs.capacity = count;
+	
 	return self;
 }
 
 - (void)dealloc
 {
-	freeStyleRunVector(&_runs);
+	if (!_backing)
+		freePackedRunVector(&_runs);
+}
+
+- (const struct PackedRunVector*)vector
+{
+	return &_runs;
 }
 
-- (NSUInteger)length
+- (NSArray*)styles
 {
-	DEBUG_ASSERT(_processed <= _runs.count);
-	return _runs.count - _processed;
+	return _styles;
 }
 
 - (NSString*)indexToName:(NSUInteger)index
@@ -74,25 +117,38 @@
 	DEBUG_ASSERT(_names.count == _styles.count);
 	
 	bool stop = false;
-	for (; _processed < _runs.count; ++_processed)
+	NSUInteger count = countPackedRuns(&_runs);
+	for (NSUInteger i = 0; i < count && !stop; ++i)
 	{
-		NSUInteger element = _runs.data[_processed].elementIndex;
+		NSUInteger element = _runs.data[i].elementIndex;
 		DEBUG_ASSERT(element < _styles.count);
-		block(element, _styles[element], _runs.data[_processed].range, &stop);
+		block(element, _styles[element], rangeOfPackedRun(&_runs, i), &stop);
+	}
+}
+
+- (void)processRange:(NSRange)range block:(ProcessStyleRun)block
+{
+	DEBUG_ASSERT(_styles);
+	
+	bool stop = false;
+	NSUInteger count = countPackedRuns(&_runs);
+	for (NSUInteger i = searchPackedRuns(&_runs, range.location); i < count && _runs.data[i].location < NSMaxRange(range); ++i)
+	{
+		NSUInteger element = _runs.data[i].elementIndex;
+		block(element, _styles[element], rangeOfPackedRun(&_runs, i), &stop);
 		if (stop)
-			break;		// run the block stopped on is not considered to be processed
+			break;
 	}
 }
 
 - (void)processIndexes:(ProcessStyleIndex)block
 {
 	bool stop = false;
-	for (; _processed < _runs.count; ++_processed)
+	NSUInteger count = countPackedRuns(&_runs);
+	for (NSUInteger i = 0; i < count && !stop; ++i)
 	{
-		NSUInteger element = _runs.data[_processed].elementIndex;
-		block(element, _runs.data[_processed].range, &stop);
-		if (stop)
-			break;		// run the block stopped on is not considered to be processed
+		NSUInteger element = _runs.data[i].elementIndex;
+		block(element, rangeOfPackedRun(&_runs, i), &stop);
 	}
 }
 
@@ -0,0 +1,24 @@
+#import <Cocoa/Cocoa.h>
+
+@class StyleRuns;
+
+/// Text storage used by TextController. Syntax styles are not copied into attribute
+/// runs: attributesAtIndex:effectiveRange: answers them directly from the StyleRuns
+/// computed by the styler task. Everything else (the attributes of documents without
+/// a language, typing attributes for text entered since the last restyle, glyph
+/// mappings, plugin attributes, etc) lives in an overlay which takes precedence over
+/// the style runs.
+///
+/// Edits don't touch the runs. Instead they are logged and lookups map locations back
+/// to the text the runs were computed for. Text inserted since the runs were installed
+/// only has overlay attributes.
+@interface StyledTextStorage : NSTextStorage
+
+/// Installs runs (which must have been computed for the current text and had their
+/// styles mapped) in place of the current runs. The syntax attributes are removed
+/// from the overlay within the range which changed and the layout managers are told
+/// to redraw that range. If all is set the entire text is considered to have changed.
+/// Returns the range which changed (which may be empty).
+- (NSRange)setStyleRuns:(StyleRuns*)runs all:(bool)all;
+
+@end
@@ -0,0 +1,306 @@
+#import "StyledTextStorage.h"
+
+#import "Assert.h"
+#import "Logger.h"
+#import "StyleRuns.h"
+
+// After this many disjoint edits new edits are merged into the last one. That
+// unstyles the text between them but the runs are usually replaced well before
+// this happens.
+#define MAX_EDITS 32
+
+// Key for the cache of merged attributes.
+struct MergeKey
+{
+	const void* style;
+	const void* overlay;
+};
+
+// Text within [location, location + oldLength) of the text before the edit was
+// replaced with newLength characters.
+struct StyleEdit
+{
+	NSUInteger location;
+	NSUInteger oldLength;
+	NSUInteger newLength;
+};
+
+// Combines an edit with the edit which followed it (i.e. the range of second is
+// relative to the text produced by first).
+static struct StyleEdit mergeEdits(struct StyleEdit first, struct StyleEdit second)
+{
+	NSUInteger start = MIN(first.location, second.location);
+	NSUInteger end = MAX(first.location + first.newLength, second.location + second.oldLength);	// within the text between the edits
+
+	struct StyleEdit result;
+	result.location = start;
+	result.oldLength = end - first.newLength + first.oldLength - start;
+	result.newLength = end - second.oldLength + second.newLength - start;
+	return result;
+}
+
+@implementation StyledTextStorage
+{
+	NSMutableAttributedString* _overlay;
+
+	StyleRuns* _runs;
+	NSArray* _styles;						// element index => attributes
+	struct StyleEdit _edits[MAX_EDITS];		// edits made since _runs was installed, oldest first
+	NSUInteger _numEdits;
+
+	NSMutableDictionary* _merged;			// style and overlay attributes => attributes
+}
+
+- (id)init
+{
+	self = [super init];
+	if (self)
+	{
+		_overlay = [NSMutableAttributedString new];
+		_merged = [NSMutableDictionary new];
+	}
+	return self;
+}
+
+- (NSString*)string
+{
+	return _overlay.string;
+}
+
+- (NSDictionary*)attributesAtIndex:(NSUInteger)location effectiveRange:(NSRangePointer)range
+{
+	NSRange overlayRange;
+	NSDictionary* attrs = [_overlay attributesAtIndex:location effectiveRange:&overlayRange];
+
+	NSRange styleRange;
+	NSDictionary* style = [self _styleAt:location range:&styleRange];
+	if (style)
+		attrs = [self _merge:style with:attrs];
+
+	if (range)
+		*range = NSIntersectionRange(overlayRange, styleRange);
+	return attrs;
+}
+
+- (void)replaceCharactersInRange:(NSRange)range withString:(NSString*)str
+{
+	NSUInteger oldLength = _overlay.length;
+	[_overlay replaceCharactersInRange:range withString:str];
+	NSInteger delta = (NSInteger) _overlay.length - (NSInteger) oldLength;
+
+	if (_runs)
+		[self _addEdit:(struct StyleEdit) {.location = range.location, .oldLength = range.length, .newLength = str.length}];
+	[self edited:NSTextStorageEditedCharacters range:range changeInLength:delta];
+}
+
+// The NSMutableAttributedString versions of the methods below are written in terms
+// of attributesAtIndex:effectiveRange: and setAttributes:range: which would copy the
+// style attributes into the overlay.
+- (void)setAttributes:(NSDictionary*)attrs range:(NSRange)range
+{
+	[_overlay setAttributes:attrs range:range];
+	[self edited:NSTextStorageEditedAttributes range:range changeInLength:0];
+}
+
+- (void)addAttribute:(NSString*)name value:(id)value range:(NSRange)range
+{
+	[_overlay addAttribute:name value:value range:range];
+	[self edited:NSTextStorageEditedAttributes range:range changeInLength:0];
+}
+
+- (void)addAttributes:(NSDictionary*)attrs range:(NSRange)range
+{
+	[_overlay addAttributes:attrs range:range];
+	[self edited:NSTextStorageEditedAttributes range:range changeInLength:0];
+}
+
+- (void)removeAttribute:(NSString*)name range:(NSRange)range
+{
+	[_overlay removeAttribute:name range:range];
+	[self edited:NSTextStorageEditedAttributes range:range changeInLength:0];
+}
+
+- (NSRange)setStyleRuns:(StyleRuns*)runs all:(bool)all
+{
+	NSUInteger length = _overlay.length;
+	NSRange changed = all || !_runs || !runs ? NSMakeRange(0, length) : [self _changedRange:runs];
+
+	_runs = runs;
+	_styles = runs.styles;
+	_numEdits = 0;
+	[_merged removeAllObjects];
+
+	if (changed.length > 0)
+	{
+		// The overlay wins so syntax attributes within it (e.g. typing attributes)
+		// would hide the new styles.
+		if (runs)
+		{
+			NSMutableSet* keys = [NSMutableSet new];
+			for (NSDictionary* style in _styles)
+				[keys addObjectsFromArray:style.allKeys];
+			for (NSString* key in keys)
+				[_overlay removeAttribute:key range:changed];
+		}
+
+		[self edited:NSTextStorageEditedAttributes range:changed changeInLength:0];
+	}
+
+	return changed;
+}
+
+// Returns the range of the current text which the new runs style differently from
+// the installed runs.
+- (NSRange)_changedRange:(StyleRuns*)runs
+{
+	NSUInteger length = _overlay.length;
+	if (![runs.styles isEqualToArray:_styles])
+		return NSMakeRange(0, length);
+
+	// Treat the edits as a single replacement.
+	struct StyleEdit span = {.location = NSNotFound, .oldLength = 0, .newLength = 0};
+	if (_numEdits > 0)
+	{
+		span = _edits[0];
+		for (NSUInteger i = 1; i < _numEdits; ++i)
+			span = mergeEdits(span, _edits[i]);
+	}
+	NSInteger delta = _numEdits > 0 ? (NSInteger) span.newLength - (NSInteger) span.oldLength : 0;
+	NSUInteger editEnd = _numEdits > 0 ? span.location + span.oldLength : 0;		// within the old text
+
+	const struct PackedRunVector* oldRuns = _runs.vector;
+	const struct PackedRunVector* newRuns = runs.vector;
+	NSUInteger oldCount = countPackedRuns(oldRuns);
+	NSUInteger newCount = countPackedRuns(newRuns);
+
+	// Leading runs before the edits which are the same.
+	NSUInteger leading = 0;
+	while (leading < oldCount && leading < newCount &&
+		oldRuns->data[leading].elementIndex == newRuns->data[leading].elementIndex &&
+		oldRuns->data[leading].location == newRuns->data[leading].location &&
+		oldRuns->data[leading+1].location == newRuns->data[leading+1].location &&
+		newRuns->data[leading+1].location <= span.location)
+	{
+		++leading;
+	}
+
+	// Trailing runs after the edits which have only moved.
+	NSUInteger trailing = 0;
+	while (trailing < oldCount - leading && trailing < newCount - leading)
+	{
+		NSUInteger i = oldCount - 1 - trailing;
+		NSUInteger j = newCount - 1 - trailing;
+		if (oldRuns->data[i].elementIndex != newRuns->data[j].elementIndex ||
+			(NSInteger) oldRuns->data[i].location + delta != (NSInteger) newRuns->data[j].location ||
+			(NSInteger) oldRuns->data[i+1].location + delta != (NSInteger) newRuns->data[j+1].location ||
+			oldRuns->data[i].location < editEnd)
+			break;
+		++trailing;
+	}
+
+	NSUInteger start = newRuns->count > 0 ? newRuns->data[leading].location : 0;
+	NSUInteger end = trailing > 0 ? newRuns->data[newCount - trailing].location : length;
+	start = MIN(start, length);
+	end = MIN(MAX(start, end), length);
+	LOG("Text:Styler:Verbose", "Skipped %lu leading and %lu trailing runs", leading, trailing);
+
+	return NSMakeRange(start, end - start);
+}
+
+- (void)_addEdit:(struct StyleEdit)edit
+{
+	struct StyleEdit* last = _numEdits > 0 ? _edits + _numEdits - 1 : NULL;
+
+	// Typing produces a lot of adjacent edits which we want to combine.
+	bool touches = last && edit.location <= last->location + last->newLength && edit.location + edit.oldLength >= last->location;
+	if (touches || _numEdits == MAX_EDITS)
+		*last = mergeEdits(*last, edit);
+	else
+		_edits[_numEdits++] = edit;
+}
+
+// Returns the style for the character at location (or nil if it has no style) and
+// sets range to the range around location which has that style.
+- (NSDictionary*)_styleAt:(NSUInteger)location range:(NSRange*)range
+{
+	NSUInteger lo = 0;
+	NSUInteger hi = _overlay.length;
+	if (!_runs)
+	{
+		*range = NSMakeRange(lo, hi - lo);
+		return nil;
+	}
+
+	// Map location back to the text the runs were computed for. Each edit's range is
+	// relative to the text just after the edit so we start with the newest edit. shift
+	// is the offset between the current text and the text we're at.
+	NSInteger shift = 0;
+	for (NSUInteger i = _numEdits; i > 0; --i)
+	{
+		struct StyleEdit edit = _edits[i-1];
+		NSUInteger loc = (NSUInteger) ((NSInteger) location - shift);
+		NSUInteger editEnd = edit.location + edit.newLength;
+		if (loc >= editEnd)
+		{
+			lo = MAX(lo, (NSUInteger) ((NSInteger) editEnd + shift));
+			shift += (NSInteger) edit.newLength - (NSInteger) edit.oldLength;
+		}
+		else if (loc >= edit.location)
+		{
+			lo = MAX(lo, (NSUInteger) ((NSInteger) edit.location + shift));
+			hi = MIN(hi, (NSUInteger) ((NSInteger) editEnd + shift));
+			*range = NSMakeRange(lo, hi - lo);
+			return nil;
+		}
+		else
+		{
+			hi = MIN(hi, (NSUInteger) ((NSInteger) edit.location + shift));
+		}
+	}
+
+	const struct PackedRunVector* runs = _runs.vector;
+	NSUInteger count = countPackedRuns(runs);
+	NSUInteger index = searchPackedRuns(runs, (NSUInteger) ((NSInteger) location - shift));
+	if (index < count)
+	{
+		NSRange run = rangeOfPackedRun(runs, index);
+		lo = MAX(lo, (NSUInteger) ((NSInteger) run.location + shift));
+		hi = MIN(hi, (NSUInteger) ((NSInteger) NSMaxRange(run) + shift));
+		*range = NSMakeRange(lo, hi - lo);
+		return _styles[runs->data[index].elementIndex];
+	}
+	else
+	{
+		// Past the end of the runs.
+		NSUInteger end = count > 0 ? runs->data[count].location : 0;
+		lo = MAX(lo, (NSUInteger) ((NSInteger) end + shift));
+		*range = NSMakeRange(lo, hi - lo);
+		return nil;
+	}
+}
+
+// The layout manager asks for attributes a lot so the merged dictionaries are
+// cached. The cache entries retain their keys so the pointers can't be reused.
+- (NSDictionary*)_merge:(NSDictionary*)style with:(NSDictionary*)overlay
+{
+	if (overlay.count == 0)
+		return style;
+
+	struct MergeKey pointers = {.style = (__bridge const void*) style, .overlay = (__bridge const void*) overlay};
+	NSValue* key = [NSValue valueWithBytes:&pointers objCType:@encode(struct MergeKey)];
+	NSArray* entry = _merged[key];
+	if (!entry)
+	{
+		if (_merged.count > 1024)
+			[_merged removeAllObjects];
+
+		NSMutableDictionary* attrs = [style mutableCopy];
+		[attrs addEntriesFromDictionary:overlay];
+		entry = @[style, overlay, attrs];
+		_merged[key] = entry;
+	}
+
+	return entry[2];
+}
+
+@end
@@ -9,16 +9,17 @@
 #import "IntegerDialogController.h"
 #import "Language.h"
 #import "Languages.h"
+#import "LineIndex.h"
 #import "MenuCategory.h"
 #import "Paths.h"
 #import "RangeVector.h"
 #import "RestoreView.h"
+#import "StyledTextStorage.h"
 #import "TextView.h"
 #import "TextDocument.h"
 #import "TextStyles.h"
 #import "TimeMachine.h"
 #import "TranscriptController.h"
-#import "UIntVectorUtils.h"
 #import "Utils.h"
 #import "WarningWindow.h"
 #import "WindowsDatabase.h"
@@ -47,8 +48,7 @@
         _chars = chars;
         _repeat = options == MappingOptionsUseGlyphsForEachChar;
         
-        NSDictionary* style = [controller.styles attributesForElement:_style];
-        _glyphs = [[GlyphsAttribute alloc] initWithStyle:style chars:_chars repeat:_repeat];
+        _glyphs = [controller.styles glyphsForElement:_style chars:_chars repeat:_repeat];
     }
     
     return self;
@@ -56,8 +56,7 @@
 
 - (void)reload:(TextController*)controller
 {
-    NSDictionary* style = [controller.styles attributesForElement:_style];
-    _glyphs = [[GlyphsAttribute alloc] initWithStyle:style chars:_chars repeat:_repeat];
+    _glyphs = [controller.styles glyphsForElement:_style chars:_chars repeat:_repeat];
 }
 
 @end
@@ -71,8 +70,9 @@
 	Language* _language;
 	TextStyles* _styles;
 	ApplyStyles* _applier;
+	StyledTextStorage* _storage;	// the layout manager doesn't retain its storage
 	NSMutableArray* _layoutBlocks;
-	struct UIntVector _lineStarts;	// first index is at zero, other indexes are one past new-lines
+	LineIndex* _lineIndex;
     NSMutableArray* _mappings;
     Settings* _layeredSettings;
     
@@ -309,7 +309,7 @@ static __weak TextController* _frontmost;
 		_styles = [self _createDefaultTextStyles];
 		
 		_layoutBlocks = [NSMutableArray new];
-		_lineStarts = newUIntVector();
+		_lineIndex = [LineIndex new];
         _mappings = [NSMutableArray new];
         
         _showLeadingSpaces = -1; // -1 == use app settings, 0 == off, 1 == on
@@ -327,13 +327,13 @@ static __weak TextController* _frontmost;
 	return self;
 }
 
-- (void)dealloc
-{
-	freeUIntVector(&_lineStarts);
-}
-
 - (void)windowDidLoad
 {
+    // Syntax styles are answered from the style runs instead of being copied into
+    // the text storage's attribute runs.
+    _storage = [StyledTextStorage new];
+    [self.textView.layoutManager replaceTextStorage:_storage];
+    
     __weak id this = self;
     [self.textView setDelegate:this];
     [self.textView.textStorage setDelegate:this];
@@ -416,6 +416,9 @@ static __weak TextController* _frontmost;
 			info.wordWrap  = self->_wordWrap;
 			NSRect frame = self.window.frame;
 			[WindowsDatabase saveInfo:&info frame:frame forPath:path];
+			
+			if (_applier)
+				[_applier saveRuns];
 		}
 		
 //		if (Path.Contains("/var/") && Path.Contains("/-Tmp-/"))		// TODO: seems kind of fragile, maybe we should have a Mimsy specific tmp directory
@@ -800,9 +803,19 @@ static __weak TextController* _frontmost;
         [[NSNotificationCenter defaultCenter] postNotificationName:@"SettingsChanged" object:self];
 
 		if (_language && !_applier)
+		{
 			_applier = [[ApplyStyles alloc] init:self];
+		}
 		else if (!_language && _applier)
+		{
+			// The syntax styles only exist in the style runs so the text needs real
+			// attributes again.
 			_applier = nil;
+			[_storage beginEditing];
+			[_storage setStyleRuns:nil all:true];
+			[_storage setAttributes:[_styles attributesForElement:@"normal"] range:NSMakeRange(0, _storage.length)];
+			[_storage endEditing];
+		}
 		
 		[self resetTextAttributes];
 		if (_applier)
@@ -839,12 +852,14 @@ static __weak TextController* _frontmost;
 	
 	if (_language)
 	{
+        // The mappings use glyphs from the styles so they have to be reloaded after
+        // the styles are.
+        _styles = [[TextStyles alloc] initWithPath:_styles.path expectBackColor:true];
         for (CharacterMapping* mapping in _mappings)
         {
             [mapping reload:self];
         }
 
-        _styles = [[TextStyles alloc] initWithPath:_styles.path expectBackColor:true];
 		if (_applier)
 			[_applier resetStyles];
 	}
@@ -905,6 +920,7 @@ static __weak TextController* _frontmost;
         _layeredSettings = [[Settings alloc] init:path.lastComponent context:self];
 		
 		NSString* name = [path lastComponent];
+		Language* oldLanguage = _language;
         if ([doc.fileType isEqualToString:@"binary"])
             self.language = [Languages findWithlangName:@"binary"];
         else
@@ -912,7 +928,7 @@ static __weak TextController* _frontmost;
 		
 		if (_restorer)
 			[_restorer setPath:path];
-		if (_applier)
+		if (_applier && _language == oldLanguage)	// setLanguage restyles if the language changed
 			[_applier addDirtyLocation:0 reason:@"path changed"];
 		
 		if (!_wordWrap)
@@ -1107,13 +1123,13 @@ static __weak TextController* _frontmost;
 	[doc.undoManager setActionName:@"Shift Lines"];
 }
 
-+ (NSUInteger)getOffset:(NSString*) text atLine:(NSInteger)line atCol:(NSInteger)col withTabWidth:(NSInteger)tabWidth
+- (NSUInteger)getOffset:(NSString*) text atLine:(NSInteger)line atCol:(NSInteger)col withTabWidth:(NSInteger)tabWidth
 {
     ASSERT(line >= 1);
     ASSERT(col == -1 || col >= 1);
     ASSERT(tabWidth >= 1);
     
-    NSUInteger begin = [TextController _getOffset:text atLine:line-1];
+    NSUInteger begin = [self _getOffset:text atLine:line-1];
     
     NSInteger c = col - 1;
     while (begin < text.length && c > 0)
@@ -1129,28 +1145,12 @@ static __weak TextController* _frontmost;
     return begin;
 }
 
-// TODO: may want to maintain a line offset table
-+ (NSUInteger)_getOffset:(NSString*) text atLine:(NSInteger)forLine
+// Returns the offset of the start of a 0-based line or the text length if there
+// aren't that many lines.
+- (NSUInteger)_getOffset:(NSString*) text atLine:(NSInteger)forLine
 {
-    NSUInteger offset = 0;
-    NSInteger line = 0;
-    
-    while (line < forLine && offset < text.length)
-    {
-        if (offset + 1 < text.length && [text characterAtIndex:offset] == '\r' && [text characterAtIndex:offset+1] == '\n')
-        {
-            ++offset;
-            ++line;
-        }
-        else if ([text characterAtIndex:offset] == '\r' || [text characterAtIndex:offset] == '\n')
-        {
-            ++line;
-        }
-        
-        ++offset;
-    }
-    
-    return offset;
+    NSUInteger offset = [_lineIndex lineToOffset:(NSUInteger) forLine text:text];
+    return offset != NSNotFound ? offset : text.length;
 }
 
 - (void)jumpToLine:(id)sender
@@ -1174,8 +1174,8 @@ static __weak TextController* _frontmost;
     
     NSString* text = self.text;
     
-    NSUInteger begin = [TextController getOffset:text atLine:line atCol:col withTabWidth:tabWidth];
-    NSUInteger end = [TextController _getOffset:text atLine:line];
+    NSUInteger begin = [self getOffset:text atLine:line atCol:col withTabWidth:tabWidth];
+    NSUInteger end = [self _getOffset:text atLine:line];
     
     if (begin > end)		// may happen if the line was edited
     {
@@ -1310,14 +1310,13 @@ static __weak TextController* _frontmost;
 	if ((mask & NSTextStorageEditedCharacters))
 	{
 		_editCount++;
-		setSizeUIntVector(&_lineStarts, 0);
 
 		NSTextStorage* storage = self.textView.textStorage;
 		NSRange range = storage.editedRange;
+		[_lineIndex edited:storage.string range:range delta:storage.changeInLength];
 		if (_applier)
 		{
-			NSUInteger loc = range.location;
-			[_applier addDirtyLocation:loc reason:@"user edit"];
+			[_applier addDirtyRange:range delta:storage.changeInLength reason:@"user edit"];
 		}
 		
 		// Auto-indent new lines.
@@ -1443,47 +1442,20 @@ static __weak TextController* _frontmost;
 // Note that line numbers are 1-based.
 - (NSUInteger)_offsetToLine:(NSUInteger)offset
 {
-	struct UIntVector* lineStarts = self._getLineStarts;
-	
-	NSUInteger line = searchUIntVector(lineStarts, offset);
-	if (line >= lineStarts->count)
-		line = ~line;
-	
-	if (line == lineStarts->count || lineStarts->data[line] != offset)
-		--line;
-	
-	return line + 1;
-	
+	return [_lineIndex offsetToLine:offset text:self.text] + 1;
 }
 
 - (NSUInteger)_lineToOffset:(NSUInteger)line
 {
 	ASSERT(line >= 1);
 	
-	struct UIntVector* lineStarts = self._getLineStarts;
-	if (line-1 < lineStarts->count)
-		return lineStarts->data[line - 1];
+	NSUInteger offset = [_lineIndex lineToOffset:line - 1 text:self.text];
+	if (offset != NSNotFound)
+		return offset;
 	else
 		return self.text.length - 1;
 }
 
-- (struct UIntVector*)_getLineStarts
-{
-	NSString* text = _textView.textStorage.string;
-	if (_lineStarts.count == 0 && text.length > 0)
-	{
-		pushUIntVector(&_lineStarts, 0);
-		for (NSUInteger i = 1; i < text.length; ++i)
-		{
-			// TextDocument strips out line feeds so this is legit.
-			if ([text characterAtIndex:i-1] == '\n')
-				pushUIntVector(&_lineStarts, i);
-		}
-	}
-	
-	return &_lineStarts;
-}
-
 - (bool)_textAt:(NSUInteger)offset matches:(NSString*)str
 {
 	bool match = false;
@@ -92,42 +92,16 @@ static NSDictionary* controlNames()
 	return names;
 }
 
-static enum LineEndian getEndian(NSString* text, bool* hasMac, bool* hasWindows)
+// Decode counts the line endings as it validates the text so we don't need to
+// scan the string again.
+static enum LineEndian getEndian(Decode* decode, bool* hasMac, bool* hasWindows)
 {
-	int counts[4] = {0};
-	*hasWindows = false;
-	*hasMac = false;
-		
-	// It's annoying to scan the entire string for line endings, but in the common
-	// case where we are dealing with Unix files we need to scan the entire file
-	// to ensure that there are no line endings we need to fix.
-	NSUInteger i = 0;
-	NSUInteger len = [text length];
-	while (i < len)
-	{
-		unichar ch = [text characterAtIndex:i];
-		if (i + 1 < len && ch == '\r' && [text characterAtIndex:i+1] == '\n')
-		{
-			*hasWindows = true;
-			counts[WindowsEndian] += 1;
-			i += 2;
-		}
-		else if (ch == '\r')
-		{
-			*hasMac = true;
-			counts[MacEndian] += 1;
-			i += 1;
-		}
-		else if (ch == '\n')
-		{
-			counts[UnixEndian] += 1;
-			i += 1;
-		}
-		else
-		{
-			i += 1;
-		}
-	}
+	NSUInteger counts[4] = {0};
+	counts[UnixEndian] = decode.unixEndings;
+	counts[MacEndian] = decode.macEndings;
+	counts[WindowsEndian] = decode.windowsEndings;
+	*hasWindows = counts[WindowsEndian] > 0;
+	*hasMac = counts[MacEndian] > 0;
 
 	// Set the endian to whichever is the most common.
 	if (counts[WindowsEndian] > counts[MacEndian] && counts[WindowsEndian] > counts[UnixEndian])
@@ -140,6 +114,16 @@ static enum LineEndian getEndian(NSString* text, bool* hasMac, bool* hasWindows)
 		return UnixEndian;
 }
 
+// Decode falls back to a legacy 8-bit encoding if it can't find a unicode encoding
+// which works.
+static bool isUnicodeEncoding(NSStringEncoding encoding)
+{
+	return encoding == NSUTF8StringEncoding ||
+		encoding == NSUTF16BigEndianStringEncoding || encoding == NSUTF16LittleEndianStringEncoding || encoding == NSUTF16StringEncoding ||
+		encoding == NSUTF32BigEndianStringEncoding || encoding == NSUTF32LittleEndianStringEncoding || encoding == NSUTF32StringEncoding ||
+		encoding == NSASCIIStringEncoding;
+}
+
 @implementation TextDocument
 {
 	TextController* _controller;
@@ -459,7 +443,7 @@ static enum LineEndian getEndian(NSString* text, bool* hasMac, bool* hasWindows)
 		if (text)
 		{
 			bool hasMac, hasWindows;
-			_endian = getEndian(text, &hasMac, &hasWindows);
+			_endian = getEndian(decode, &hasMac, &hasWindows);
 			_encoding = decode.encoding;
             if (hasWindows && hasMac)
                 LOG("Text", "The document has both mac and windows line endings");
@@ -468,8 +452,12 @@ static enum LineEndian getEndian(NSString* text, bool* hasMac, bool* hasWindows)
             else if (hasMac)
                 LOG("Text", "The document has windows line endings");
 			
-			if (self.encoding == NSMacOSRomanStringEncoding)
-				[TranscriptController writeError:@"Read the file as Mac OS Roman (it isn't utf-8, utf-16, or utf-32)."];
+			if (!isUnicodeEncoding(self.encoding))
+			{
+				NSString* name = [NSString localizedNameOfStringEncoding:self.encoding];
+				NSString* mesg = [NSString stringWithFormat:@"Read the file as %@ (it isn't utf-8, utf-16, or utf-32).", name];
+				[TranscriptController writeError:mesg];
+			}
 			
 			// To make life easier on ourselves text documents in memory are always
 			// unix endian (this will also fixup files with mixed line endings).
@@ -1,6 +1,8 @@
 #import <Foundation/Foundation.h>
 #import "MimsyPlugins.h"
 
+@class GlyphsAttribute;
+
 /// This is used with Mimsy settings files formatted as rtf documents.
 /// In addition to providing the values for keys it provides the text
 /// attributes used with the key.
@@ -17,6 +19,10 @@
 /// is not present.
 - (NSDictionary*)attributesForOnlyElement:(NSString*)name;
 
+/// Returns glyphs for chars drawn using the attributes for an element. These
+/// are cached because creating them requires a layout manager.
+- (GlyphsAttribute*)glyphsForElement:(NSString*)name chars:(NSString*)chars repeat:(bool)repeat;
+
 - (NSColor*)backColor;
 
 /// Returns nil if the key isn't present.
@@ -1,6 +1,7 @@
 #import "TextStyles.h"
 
 #import "ConfigParser.h"
+#import "GlyphsAttribute.h"
 #import "Metadata.h"
 #import "Paths.h"
 #import "TranscriptController.h"
@@ -12,6 +13,7 @@ static NSDictionary* _baseAttrs;
 {
 	MimsyPath* _path;					// path to the styles file
 	NSMutableDictionary* _attrMap;		// element name => attributes
+	NSMutableDictionary* _glyphsMap;	// element name, chars, and repeat => GlyphsAttribute
 	NSColor* _backColor;
 	NSDictionary* _values;
 }
@@ -43,6 +45,7 @@ static NSDictionary* _baseAttrs;
 	if (!text || ![self _parseStyles:text attrMap:map path:path])
 		map[@"normal"] = _baseAttrs;
 	_attrMap = map;
+	_glyphsMap = [NSMutableDictionary new];
 	
 	NSError* error = nil;
 	NSColor* color = [Metadata readCriticalDataFrom:_path named:@"back-color" outError:&error];
@@ -84,6 +87,20 @@ static NSDictionary* _baseAttrs;
 	return result;
 }
 
+- (GlyphsAttribute*)glyphsForElement:(NSString*)name chars:(NSString*)chars repeat:(bool)repeat
+{
+	NSString* key = [NSString stringWithFormat:@"%@\t%@\t%d", name, chars, repeat];
+	GlyphsAttribute* result = _glyphsMap[key];
+	if (!result)
+	{
+		NSDictionary* style = [self attributesForElement:name];
+		result = [[GlyphsAttribute alloc] initWithStyle:style chars:chars repeat:repeat];
+		_glyphsMap[key] = result;
+	}
+	
+	return result;
+}
+
 - (NSColor*)backColor
 {
 	return _backColor;
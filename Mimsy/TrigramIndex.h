@@ -0,0 +1,44 @@
+#import <Foundation/Foundation.h>
+#import "MimsyPlugins.h"
+
+/// Persistent index of the trigrams within the files under a directory. Find in
+/// Files uses this to skip files which cannot match without reading them. Each
+/// file gets a small bloom filter of its (ASCII case folded) trigrams so the index
+/// may report false positives but never false negatives. Files which have changed
+/// since they were indexed are always treated as possible matches so searches
+/// return the same results as a full scan.
+@interface TrigramIndex : NSObject
+
+/// Loads the index for root from the caches directory (if present) and brings
+/// it up to date on a background thread. Must be called from the main thread.
++ (TrigramIndex*)open:(MimsyPath*)root;
+
+/// Returns the open index which covers path or nil. Must be called from the
+/// main thread.
++ (TrigramIndex*)indexFor:(MimsyPath*)path;
+
+/// Returns the trigrams that any match of regex must contain or nil if there
+/// aren't any. Case insensitive matches of ASCII letters can match ligatures
+/// and symbols like the Kelvin sign so unicode should be set to get the trigrams
+/// to use for files which contain non-ASCII characters.
++ (NSData*)trigramsFor:(NSRegularExpression*)regex unicode:(bool)unicode;
+
+/// Returns the ASCII literals (as bytes) that any match of regex must contain or
+/// nil if there aren't any. Unicode is as above. Note that the literals are not
+/// case folded.
++ (NSArray<NSData*>*)literalsFor:(NSRegularExpression*)regex unicode:(bool)unicode;
+
+/// Saves the index and stops tracking changes.
+- (void)close;
+
+/// Called when the contents of dir (or its sub-directories) have changed.
+- (void)dirChanged:(MimsyPath*)dir;
+
+/// Returns false if the file cannot contain the trigrams. Unicode is used for files
+/// with non-ASCII characters and may be nil (in which case those files are assumed
+/// to match).
+- (bool)mayMatch:(MimsyPath*)path ascii:(NSData*)ascii unicode:(NSData*)unicode;	// threaded
+
+@property (readonly) MimsyPath* root;
+
+@end
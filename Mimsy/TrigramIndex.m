@@ -0,0 +1,651 @@
+#import "TrigramIndex.h"
+
+#include <sys/stat.h>
+
+#import "AppDelegate.h"
+#import "Glob.h"
+#import "Logger.h"
+#import "Paths.h"
+#import "Utils.h"
+
+// Big files are rarely source and would need big blooms.
+const uint64_t MaxIndexedSize = 16*1024*1024;
+
+// Blooms use about one bit per byte of the file which, because source has lots
+// of repeated trigrams, gives a low false positive rate.
+const uint32_t MinBloomBits = 9;		// log2 of the number of bits
+const uint32_t MaxBloomBits = 22;
+
+// Changes are batched up before the index is re-written.
+const double SaveDelay = 60.0;
+
+const uint32_t IndexMagic = 0x4D475254;		// "TRGM"
+const uint32_t IndexVersion = 1;
+
+// The index file is the header followed by numFiles records, the paths, and the
+// blooms. Paths are UTF-8 (without a terminating zero) and blooms are 8 byte
+// aligned.
+struct IndexHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t numFiles;
+	uint64_t pathsSize;
+	uint64_t bloomsSize;
+};
+
+struct IndexRecord
+{
+	int64_t mtimeSecs;
+	int64_t mtimeNanos;
+	uint64_t size;
+	uint64_t pathOffset;
+	uint64_t bloomOffset;
+	uint32_t pathLength;
+	uint16_t logBits;		// zero if the file could not be indexed
+	uint16_t ascii;			// true if the file has no bytes >= 0x80
+};
+
+// Info about an indexed file. These are not changed once created.
+@interface IndexedFile : NSObject
+@property (nonatomic) struct IndexRecord record;
+@property (nonatomic) NSData* bloom;
+@end
+
+@implementation IndexedFile
+@end
+
+static NSMutableArray* _indexes;
+
+@implementation TrigramIndex
+{
+	NSString* _file;
+	Glob* _excludeGlobs;
+	dispatch_queue_t _queue;	// loads, updates, and saves are serialized using this
+
+	NSLock* _lock;				// protects _entries
+	NSMutableDictionary* _entries;	// path string => IndexedFile
+	NSData* _mapped;			// blooms loaded from disk point into this
+
+	bool _dirty;
+	bool _saveQueued;
+	bool _closed;
+}
+
++ (TrigramIndex*)open:(MimsyPath*)root
+{
+	if (!_indexes)
+		_indexes = [NSMutableArray new];
+
+	TrigramIndex* index = [[TrigramIndex alloc] initWithRoot:root];
+	if (index)
+		[_indexes addObject:index];
+	return index;
+}
+
++ (TrigramIndex*)indexFor:(MimsyPath*)path
+{
+	for (TrigramIndex* index in _indexes)
+	{
+		if ([path hasRoot:index.root])
+			return index;
+	}
+
+	return nil;
+}
+
+- (id)initWithRoot:(MimsyPath*)root
+{
+	NSString* caches = Paths.caches;
+	if (!caches)
+		return nil;
+
+	NSString* dir = [caches stringByAppendingPathComponent:@"Trigrams"];
+	NSError* error = nil;
+	if (![[NSFileManager defaultManager] createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:&error])
+	{
+		LOG("Error", "Couldn't create '%s': %s", STR(dir), STR([error localizedFailureReason]));
+		return nil;
+	}
+
+	self = [super init];
+	if (self)
+	{
+		_root = root;
+		_file = [dir stringByAppendingPathComponent:[NSString stringWithFormat:@"%016llx.index", hashString(FNVOffsetBasis, root.asString)]];
+		_lock = [NSLock new];
+		_entries = [NSMutableDictionary new];
+		_queue = dispatch_queue_create("mimsy.trigrams", DISPATCH_QUEUE_SERIAL);
+		dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+
+		// Find in Files never searches these so there's no point in indexing them.
+		AppDelegate* app = (AppDelegate*) [NSApp delegate];
+		NSArray* globs = [[app.layeredSettings stringValue:@"FindAllAlwaysExclude" missing:@""] splitByString:@" "];
+		_excludeGlobs = [[Glob alloc] initWithGlobs:globs];
+
+		dispatch_async(_queue, ^{
+			[self _load];
+			[self _refresh:root];
+		});
+	}
+
+	return self;
+}
+
+- (void)close
+{
+	[_indexes removeObject:self];
+
+	dispatch_async(_queue, ^{
+		self->_closed = true;
+		if (self->_dirty)
+			[self _save];
+	});
+}
+
+- (void)dirChanged:(MimsyPath*)dir
+{
+	dispatch_async(_queue, ^{
+		if (!self->_closed)
+			[self _refresh:dir];
+	});
+}
+
+#pragma mark - Queries
+
+static inline uint8_t foldByte(uint8_t b)
+{
+	return b >= 'A' && b <= 'Z' ? b + ('a' - 'A') : b;
+}
+
+static inline uint32_t bloomHash1(uint32_t trigram, uint32_t logBits)
+{
+	return (trigram*2654435761u) >> (32 - logBits);
+}
+
+static inline uint32_t bloomHash2(uint32_t trigram, uint32_t logBits)
+{
+	return (trigram*2246822519u + 374761393u) >> (32 - logBits);
+}
+
+static inline bool testBit(const uint8_t* bits, uint32_t i)
+{
+	return (bits[i >> 3] & (1u << (i & 7))) != 0;
+}
+
+- (bool)mayMatch:(MimsyPath*)path ascii:(NSData*)ascii unicode:(NSData*)unicode	// threaded
+{
+	struct stat info;
+	if (stat(path.asString.UTF8String, &info) != 0)
+		return true;		// let the find code report the error
+
+	[_lock lock];
+	IndexedFile* file = _entries[path.asString];
+	[_lock unlock];
+
+	struct IndexRecord record = file.record;
+	if (!file || record.logBits == 0 || record.size != (uint64_t) info.st_size ||
+		record.mtimeSecs != info.st_mtimespec.tv_sec || record.mtimeNanos != info.st_mtimespec.tv_nsec)
+		return true;
+
+	NSData* trigrams = record.ascii ? ascii : unicode;
+	if (!trigrams)
+		return true;
+
+	const uint32_t* data = trigrams.bytes;
+	const uint8_t* bits = file.bloom.bytes;
+	for (NSUInteger i = 0; i < trigrams.length/sizeof(uint32_t); ++i)
+	{
+		if (!testBit(bits, bloomHash1(data[i], record.logBits)) || !testBit(bits, bloomHash2(data[i], record.logBits)))
+			return false;
+	}
+
+	return true;
+}
+
+static bool isOneOf(unichar ch, const char* chars)
+{
+	return ch > 0 && ch < 0x80 && strchr(chars, ch) != NULL;
+}
+
+// Letters which case insensitive matches can match against non-ASCII characters,
+// e.g. the Kelvin sign, long s, and ligatures like "ﬁ".
+static bool isUnicodeFoldable(unichar ch)
+{
+	return isOneOf(ch, "afhijklnstwy");
+}
+
+static void addLiteral(NSMutableArray* literals, NSMutableData* run)
+{
+	if (run.length > 0)
+		[literals addObject:[run copy]];
+	run.length = 0;
+}
+
+static NSUInteger skipPast(NSString* pattern, NSUInteger i, unichar end)
+{
+	while (i < pattern.length && [pattern characterAtIndex:i] != end)
+		++i;
+	return MIN(i + 1, pattern.length);
+}
+
+// Character classes can be nested and may start with a literal ']'.
+static NSUInteger skipClass(NSString* pattern, NSUInteger i)
+{
+	NSUInteger depth = 1;
+	if (i < pattern.length && [pattern characterAtIndex:i] == '^')
+		++i;
+	if (i < pattern.length && [pattern characterAtIndex:i] == ']')
+		++i;
+
+	while (i < pattern.length && depth > 0)
+	{
+		unichar ch = [pattern characterAtIndex:i++];
+		if (ch == '\\')
+			++i;
+		else if (ch == '[')
+			++depth;
+		else if (ch == ']')
+			--depth;
+	}
+	return MIN(i, pattern.length);
+}
+
++ (NSData*)trigramsFor:(NSRegularExpression*)regex unicode:(bool)unicode
+{
+	NSMutableData* trigrams = [NSMutableData new];
+	for (NSData* literal in [TrigramIndex literalsFor:regex unicode:unicode])
+	{
+		const uint8_t* bytes = literal.bytes;
+		for (NSUInteger i = 2; i < literal.length; ++i)
+		{
+			uint32_t trigram = (uint32_t) foldByte(bytes[i-2]) << 16 | (uint32_t) foldByte(bytes[i-1]) << 8 | foldByte(bytes[i]);
+			[trigrams appendBytes:&trigram length:sizeof(trigram)];
+		}
+	}
+	
+	return trigrams.length > 0 ? trigrams : nil;
+}
+
+// This is conservative: it only has to find some of the literal text that every
+// match must contain and anything it doesn't understand just ends the current
+// literal (or, if that might not be safe, gives up entirely). Only top level
+// ASCII literals are used because Decode may not treat other bytes as UTF-8.
++ (NSArray*)literalsFor:(NSRegularExpression*)regex unicode:(bool)unicode
+{
+	NSRegularExpressionOptions options = regex.options;
+	bool ignoreCase = (options & NSRegularExpressionCaseInsensitive) != 0;
+	bool extended = (options & NSRegularExpressionAllowCommentsAndWhitespace) != 0;
+	bool literal = (options & NSRegularExpressionIgnoreMetacharacters) != 0;
+	NSString* pattern = regex.pattern;
+
+	NSMutableArray* literals = [NSMutableArray new];
+	NSMutableData* run = [NSMutableData new];
+	bool lastWasLiteral = false;
+	NSUInteger depth = 0;
+
+	NSUInteger i = 0;
+	while (i < pattern.length)
+	{
+		unichar ch = [pattern characterAtIndex:i++];
+		int lit = -1;
+
+		if (literal)
+		{
+			lit = ch;
+		}
+		else if (ch == '\\')
+		{
+			if (i == pattern.length)
+				return nil;
+			unichar next = [pattern characterAtIndex:i++];
+			if (next < 0x80 && isalnum(next))
+			{
+				// Escapes which take arguments (e.g. \x41 or \p{L}) or quote
+				// (\Q...\E) would need more parsing.
+				if (!isOneOf(next, "bBdDsSwWAZzGnrtfeahHvVRX"))
+					return nil;
+			}
+			else
+			{
+				lit = next;
+			}
+		}
+		else if (ch == '(')
+		{
+			// Inline flags like (?i) and comments change how the rest is parsed.
+			if (i + 1 < pattern.length && [pattern characterAtIndex:i] == '?' && !isOneOf([pattern characterAtIndex:i+1], ":=!<>"))
+				return nil;
+			++depth;
+		}
+		else if (ch == ')')
+		{
+			if (depth > 0)
+				--depth;
+		}
+		else if (ch == '|')
+		{
+			if (depth == 0)
+				return nil;		// none of the literals are required
+		}
+		else if (ch == '[')
+		{
+			i = skipClass(pattern, i);
+		}
+		else if (ch == '?' || ch == '*' || ch == '{')
+		{
+			// The atom before the quantifier is optional.
+			if (lastWasLiteral && run.length > 0)
+				run.length -= 1;
+			if (ch == '{')
+				i = skipPast(pattern, i, '}');
+		}
+		else if (ch == '+' || ch == '.' || ch == '^' || ch == '$')
+		{
+		}
+		else if (extended && (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'))
+		{
+			continue;	// ignored so this doesn't end the literal
+		}
+		else if (extended && ch == '#')
+		{
+			i = skipPast(pattern, i, '\n');
+			continue;
+		}
+		else
+		{
+			lit = ch;
+		}
+
+		if (lit > 0 && lit < 0x80 && depth == 0 && !(ignoreCase && unicode && isUnicodeFoldable(foldByte((uint8_t) lit))))
+		{
+			uint8_t b = (uint8_t) lit;
+			[run appendBytes:&b length:1];
+			lastWasLiteral = true;
+		}
+		else
+		{
+			addLiteral(literals, run);
+			lastWasLiteral = false;
+		}
+	}
+	addLiteral(literals, run);
+
+	return literals.count > 0 ? literals : nil;
+}
+
+#pragma mark - Indexing
+
+static inline void setBit(uint8_t* bits, uint32_t i)
+{
+	bits[i >> 3] |= 1u << (i & 7);
+}
+
+static IndexedFile* indexFile(NSString* path, const struct stat* info)		// threaded
+{
+	struct IndexRecord record = {
+		.mtimeSecs = info->st_mtimespec.tv_sec,
+		.mtimeNanos = info->st_mtimespec.tv_nsec,
+		.size = (uint64_t) info->st_size};
+
+	IndexedFile* file = [IndexedFile new];
+	if (record.size <= MaxIndexedSize)
+	{
+		NSData* data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+		const uint8_t* bytes = data.bytes;
+		NSUInteger length = data.length;
+
+		// Files with zeros are binary or UTF-16/32 so their trigrams won't match
+		// those in the decoded text.
+		if (data && memchr(bytes, 0, length) == NULL &&
+			!(length >= 2 && ((bytes[0] == 0xFE && bytes[1] == 0xFF) || (bytes[0] == 0xFF && bytes[1] == 0xFE))))
+		{
+			uint32_t logBits = MinBloomBits;
+			while (logBits < MaxBloomBits && (1u << logBits) < length)
+				++logBits;
+
+			NSMutableData* bloom = [NSMutableData dataWithLength:(1u << logBits)/8];
+			uint8_t* bits = bloom.mutableBytes;
+			bool ascii = true;
+			uint32_t trigram = 0;
+			for (NSUInteger i = 0; i < length; ++i)
+			{
+				ascii = ascii && bytes[i] < 0x80;
+				trigram = (trigram << 8 | foldByte(bytes[i])) & 0xFFFFFF;
+				if (i >= 2)
+				{
+					setBit(bits, bloomHash1(trigram, logBits));
+					setBit(bits, bloomHash2(trigram, logBits));
+				}
+			}
+
+			record.logBits = (uint16_t) logBits;
+			record.ascii = ascii;
+			file.bloom = bloom;
+		}
+	}
+	file.record = record;
+
+	return file;
+}
+
+static bool isCurrent(IndexedFile* file, const struct stat* info)
+{
+	struct IndexRecord record = file.record;
+	return record.size == (uint64_t) info->st_size && record.mtimeSecs == info->st_mtimespec.tv_sec && record.mtimeNanos == info->st_mtimespec.tv_nsec;
+}
+
+// Re-indexes the files under dir which have changed and removes the files which
+// no longer exist.
+- (void)_refresh:(MimsyPath*)dir	// threaded
+{
+	double startTime = getTime();
+	__block NSUInteger numIndexed = 0;
+	NSMutableSet* seen = [NSMutableSet new];
+
+	AppDelegate* app = (AppDelegate*) [NSApp delegate];
+	[app enumerateConcurrentlyWithDir:dir recursive:true
+		error:^(NSString* _Nonnull error)
+		{
+			LOG("Find:Verbose", "Trigram index: %s", STR(error));
+		}
+		dirPredicate:^BOOL(MimsyPath* _Nonnull parent, NSString* _Nonnull name)
+		{
+			return ![self->_excludeGlobs matchName:name] && ![self->_excludeGlobs matchStr:[parent appendWithComponent:name].asString.UTF8String];
+		}
+		predicate:^BOOL(MimsyPath* _Nonnull parent, NSString* _Nonnull name)
+		{
+			return ![self->_excludeGlobs matchStr:parent.asString.UTF8String] && ![self->_excludeGlobs matchName:name];
+		}
+		callback:^(MimsyPath* _Nonnull parent, NSArray<NSString*>* _Nonnull names)
+		{
+			NSMutableArray* paths = [NSMutableArray arrayWithCapacity:names.count];
+			NSMutableArray* changed = [NSMutableArray new];
+			for (NSString* name in names)
+			{
+				NSString* path = [parent appendWithComponent:name].asString;
+				[paths addObject:path];
+
+				struct stat info;
+				if (stat(path.UTF8String, &info) == 0)
+				{
+					[self->_lock lock];
+					IndexedFile* file = self->_entries[path];
+					[self->_lock unlock];
+
+					if (!file || !isCurrent(file, &info))
+						[changed addObject:path];
+				}
+			}
+
+			// Reading the files is the slow part so it's done concurrently.
+			dispatch_queue_t concurrent = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0);
+			dispatch_apply(changed.count, concurrent, ^(size_t i)
+			{
+				@autoreleasepool
+				{
+					NSString* path = changed[i];
+					struct stat info;
+					if (stat(path.UTF8String, &info) == 0)
+					{
+						IndexedFile* file = indexFile(path, &info);
+						[self->_lock lock];
+						self->_entries[path] = file;
+						[self->_lock unlock];
+					}
+				}
+			});
+
+			// The walker calls this concurrently.
+			[self->_lock lock];
+			[seen addObjectsFromArray:paths];
+			numIndexed += changed.count;
+			[self->_lock unlock];
+		}];
+
+	NSString* prefix = [dir.asString stringByAppendingString:@"/"];
+	[_lock lock];
+	NSArray* removed = [_entries.allKeys filteredArrayUsingBlock:^bool(NSString* path) {return [path hasPrefix:prefix] && ![seen containsObject:path];}];
+	[_entries removeObjectsForKeys:removed];
+	[_lock unlock];
+
+	if (numIndexed > 0 || removed.count > 0)
+	{
+		LOG("Find", "Trigram index for %s indexed %lu and removed %lu files (%.1fs)", STR(dir), numIndexed, removed.count, getTime() - startTime);
+		_dirty = true;
+		[self _queueSave];
+	}
+}
+
+#pragma mark - Persistence
+
+- (void)_queueSave	// threaded
+{
+	if (!_saveQueued)
+	{
+		_saveQueued = true;
+		dispatch_time_t delay = dispatch_time(DISPATCH_TIME_NOW, (int64_t) (SaveDelay*NSEC_PER_SEC));
+		dispatch_after(delay, _queue, ^{
+			self->_saveQueued = false;
+			if (self->_dirty && !self->_closed)
+				[self _save];
+		});
+	}
+}
+
+- (void)_load	// threaded
+{
+	NSData* data = [NSData dataWithContentsOfFile:_file options:NSDataReadingMappedAlways error:NULL];
+	if (!data)
+		return;		// usually because the root has never been indexed
+
+	const uint8_t* bytes = data.bytes;
+	const struct IndexHeader* header = (const struct IndexHeader*) bytes;
+	if (data.length < sizeof(struct IndexHeader) || header->magic != IndexMagic || header->version != IndexVersion ||
+		data.length != sizeof(struct IndexHeader) + header->numFiles*sizeof(struct IndexRecord) + header->pathsSize + header->bloomsSize)
+	{
+		LOG("Error", "Ignoring bad trigram index '%s'", STR(_file));
+		return;
+	}
+
+	const struct IndexRecord* records = (const struct IndexRecord*) (header + 1);
+	const uint8_t* paths = (const uint8_t*) (records + header->numFiles);
+	const uint8_t* blooms = paths + header->pathsSize;
+
+	NSMutableDictionary* entries = [NSMutableDictionary dictionaryWithCapacity:header->numFiles];
+	for (uint64_t i = 0; i < header->numFiles; ++i)
+	{
+		struct IndexRecord record = records[i];
+		uint64_t bloomSize = record.logBits > 0 ? (1u << record.logBits)/8 : 0;
+		if (record.pathOffset + record.pathLength > header->pathsSize || record.logBits > MaxBloomBits ||
+			(record.logBits > 0 && record.logBits < MinBloomBits) || record.bloomOffset + bloomSize > header->bloomsSize)
+		{
+			LOG("Error", "Ignoring corrupt trigram index '%s'", STR(_file));
+			return;
+		}
+
+		IndexedFile* file = [IndexedFile new];
+		file.record = record;
+		if (bloomSize > 0)
+			file.bloom = [NSData dataWithBytesNoCopy:(void*) (blooms + record.bloomOffset) length:bloomSize freeWhenDone:NO];
+
+		NSString* path = [[NSString alloc] initWithBytes:paths + record.pathOffset length:record.pathLength encoding:NSUTF8StringEncoding];
+		if (path)
+			entries[path] = file;
+	}
+
+	[_lock lock];
+	_mapped = data;
+	_entries = entries;
+	[_lock unlock];
+	LOG("Find", "Loaded trigram index for %s with %lu files", STR(_root), entries.count);
+}
+
+- (void)_save	// threaded
+{
+	[_lock lock];
+	NSDictionary* entries = [_entries copy];
+	[_lock unlock];
+	_dirty = false;
+
+	// Layout the file.
+	NSArray* paths = entries.allKeys;
+	uint64_t pathsSize = 0;
+	uint64_t bloomsSize = 0;
+	struct IndexRecord* records = malloc(MAX(paths.count, 1)*sizeof(struct IndexRecord));
+	for (NSUInteger i = 0; i < paths.count; ++i)
+	{
+		NSString* path = paths[i];
+		IndexedFile* file = entries[path];
+		records[i] = file.record;
+		records[i].pathOffset = pathsSize;
+		records[i].pathLength = (uint32_t) strlen(path.UTF8String);
+		records[i].bloomOffset = bloomsSize;
+		pathsSize += records[i].pathLength;
+		bloomsSize += file.bloom.length;
+	}
+
+	uint64_t padding = (8 - pathsSize % 8) % 8;		// so that the blooms are aligned
+	for (NSUInteger i = 0; i < paths.count; ++i)
+		records[i].pathOffset += padding;
+	pathsSize += padding;
+
+	struct IndexHeader header = {.magic = IndexMagic, .version = IndexVersion, .numFiles = paths.count, .pathsSize = pathsSize, .bloomsSize = bloomsSize};
+
+	// Write it out to a temporary file and then rename it so that readers never
+	// see a partial index.
+	NSString* tmpFile = [_file stringByAppendingString:@".tmp"];
+	FILE* fp = fopen(tmpFile.UTF8String, "wb");
+	bool ok = fp != NULL;
+	if (ok)
+	{
+		const uint64_t zeros = 0;
+		ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = ok && fwrite(records, sizeof(struct IndexRecord), paths.count, fp) == paths.count;
+		ok = ok && fwrite(&zeros, 1, padding, fp) == padding;
+		for (NSUInteger i = 0; i < paths.count && ok; ++i)
+		{
+			NSString* path = paths[i];
+			ok = fwrite(path.UTF8String, 1, records[i].pathLength, fp) == records[i].pathLength;
+		}
+		for (NSUInteger i = 0; i < paths.count && ok; ++i)
+		{
+			IndexedFile* file = entries[paths[i]];
+			ok = fwrite(file.bloom.bytes, 1, file.bloom.length, fp) == file.bloom.length;
+		}
+		ok = fclose(fp) == 0 && ok;
+	}
+	free(records);
+
+	if (ok && rename(tmpFile.UTF8String, _file.UTF8String) == 0)
+	{
+		LOG("Find:Verbose", "Saved trigram index for %s", STR(_root));
+	}
+	else
+	{
+		LOG("Error", "Couldn't write '%s': %s", STR(_file), strerror(errno));
+		(void) unlink(tmpFile.UTF8String);
+	}
+}
+
+@end
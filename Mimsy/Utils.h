@@ -9,6 +9,15 @@ extern const time_t MainThreadTimeOut;
 bool rangeIntersectsIndex(NSRange range, NSUInteger index);
 bool rangeIntersects(NSRange lhs, NSRange rhs);
 
+/// FNV-1a hash of bytes. Pass in FNVOffsetBasis to start a new hash or the
+/// result of a previous call to hash multiple pieces of data.
+extern const uint64_t FNVOffsetBasis;
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length);
+
+/// Hashes the string's UTF-8 bytes (including the terminating zero so that
+/// hashes of "ab", "c" and "a", "bc" differ).
+uint64_t hashString(uint64_t hash, NSString* str);
+
 /// Misc utility functions.
 @interface Utils : NSObject
 
@@ -30,6 +30,25 @@ bool rangeIntersects(NSRange lhs, NSRange rhs)
 	return intersects;
 }
 
+const uint64_t FNVOffsetBasis = 14695981039346656037ULL;
+
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length)
+{
+	const uint8_t* data = bytes;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint64_t hashString(uint64_t hash, NSString* str)
+{
+	const char* bytes = str.UTF8String;
+	return hashBytes(hash, bytes, strlen(bytes) + 1);
+}
+
 @implementation Utils
 
 + (NSString*)bytesToStr:(NSUInteger)bytes
@@ -0,0 +1,22 @@
+#import <Foundation/Foundation.h>
+
+/// Thread safe bounded FIFO used to hand work from a producer thread to a
+/// pool of worker threads. Producers block when the queue is full which keeps
+/// memory bounded when the producer is faster than the workers. Workers take
+/// the next item as soon as they are idle so a slow item only holds up the
+/// worker processing it.
+@interface WorkQueue : NSObject
+
+- (id)initWithCapacity:(NSUInteger)capacity;
+
+/// Blocks while the queue is full. Must not be called after close.
+- (void)push:(id)item;
+
+/// Blocks while the queue is empty. Returns nil once the queue has been
+/// closed and all the items have been popped.
+- (id)pop;
+
+/// Called by the producer once it has pushed everything.
+- (void)close;
+
+@end
@@ -0,0 +1,64 @@
+#import "WorkQueue.h"
+
+@implementation WorkQueue
+{
+	NSCondition* _condition;
+	NSMutableArray* _items;
+	NSUInteger _capacity;
+	bool _closed;
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity
+{
+	ASSERT(capacity > 0);
+
+	self = [super init];
+	if (self)
+	{
+		_condition = [NSCondition new];
+		_items = [NSMutableArray arrayWithCapacity:capacity];
+		_capacity = capacity;
+	}
+	return self;
+}
+
+- (void)push:(id)item
+{
+	[_condition lock];
+	ASSERT(!_closed);
+	while (_items.count >= _capacity)
+		[_condition wait];
+
+	[_items addObject:item];
+	[_condition broadcast];
+	[_condition unlock];
+}
+
+- (id)pop
+{
+	id item = nil;
+
+	[_condition lock];
+	while (_items.count == 0 && !_closed)
+		[_condition wait];
+
+	if (_items.count > 0)
+	{
+		item = _items[0];
+		[_items removeObjectAtIndex:0];		// NSMutableArray is a deque so this is cheap
+		[_condition broadcast];
+	}
+	[_condition unlock];
+
+	return item;
+}
+
+- (void)close
+{
+	[_condition lock];
+	_closed = true;
+	[_condition broadcast];
+	[_condition unlock];
+}
+
+@end
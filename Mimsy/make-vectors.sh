@@ -8,3 +8,4 @@
 ./Mimsy/create-vector.py --element=int --struct=TestVector --size=NSUInteger > ./MimsyTests/TestVector.h
 ./Mimsy/create-vector.py --element=NSUInteger --struct=UIntVector --size=NSUInteger > ./Mimsy/UIntVector.h
 ./Mimsy/create-vector.py --element='struct StyleRun' --struct=StyleRunVector --size=NSUInteger --headers='StyleRun.h' > ./Mimsy/StyleRunVector.h
+./Mimsy/create-vector.py --element='struct PackedRun' --struct=PackedRunVector --size=NSUInteger --headers='PackedRun.h' > ./Mimsy/PackedRunVector.h
@@ -8,6 +8,7 @@ public typealias ProjectContextMenuItemTitle = (_ files: [MimsyPath], _ dirs: [M
 public typealias InvokeProjectCommand = (_ files: [MimsyPath], _ dirs: [MimsyPath]) -> ()
 public typealias TextRangeCallback = (MimsyTextView, NSRange) -> ()
 public typealias ProjectCallback = (MimsyProject) -> ()
+public typealias ProjectPathCallback = (MimsyProject, MimsyPath, Bool) -> ()
 public typealias FilePredicate = (MimsyPath, String) -> Bool
 
 public typealias InvokeTextCommand = (MimsyTextView) -> ()
@@ -89,6 +90,13 @@ public typealias TextContextMenuItemCallback = (MimsyTextView) -> [TextContextMe
     /// - Parameter callback: Called with the full path of a directory and an array of non-hidden file names.
     func enumerate(dir: MimsyPath, recursive: Bool, error: (String) -> (), predicate: FilePredicate, callback: (MimsyPath, [String]) -> ())
     
+    /// Like enumerate except that directories are read by a pool of threads and
+    /// sub-directories can be skipped. Note that all of the blocks may be called
+    /// concurrently.
+    ///
+    /// - Parameter dirPredicate: Called with a directory and the name of a sub-directory. Returns true if the sub-directory should be processed.
+    func enumerateConcurrently(dir: MimsyPath, recursive: Bool, error: @escaping (String) -> (), dirPredicate: @escaping FilePredicate, predicate: @escaping FilePredicate, callback: @escaping (MimsyPath, [String]) -> ())
+    
     /// Typically the extension method will be used instead of this.
     func addNewMenuItem(_ item: NSMenuItem, loc: MenuItemLoc, sel: String, enabled: EnabledMenuItem?, invoke: @escaping InvokeMenuItem) -> Bool
     
@@ -101,6 +109,13 @@ public typealias TextContextMenuItemCallback = (MimsyTextView) -> [TextContextMe
     /// Registers a function that will be called when various project related events happen.
     func registerProject(_ kind: ProjectNotification, _ hook: @escaping ProjectCallback)
     
+    /// Registers a function that will be called with the path to a file or directory
+    /// within a project that changed. This is called just before the changed project
+    /// notification. If the path is a directory then files within it were created,
+    /// removed, or renamed. If the bool is true then anything under the path may have
+    /// changed (e.g. because file system events were dropped).
+    func registerProjectChanged(_ hook: @escaping ProjectPathCallback)
+    
     /// Registers a function that will be called when various text view related events happen.
     func registerTextView(_ kind: TextViewNotification, _ hook: @escaping TextViewCallback)
 
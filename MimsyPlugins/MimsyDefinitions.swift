@@ -57,6 +57,10 @@ public protocol MimsyDefinitions
     
     /// Returns zero or more paths to declarations for a name.
     func definitions(_ project: MimsyProject, name: String) -> [ItemPath]
+    
+    /// Returns the sorted names with a declaration or definition which start with
+    /// prefix. This is useful for things like completion.
+    func names(_ project: MimsyProject, prefix: String) -> [String]
 }
 
 /// Initialized by (hopefully one) plugin at stage 0.